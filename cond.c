@@ -6,27 +6,46 @@ void cond_init(cond_t *c) {
   QUEUE_INIT(&c->waiting);
 }
 
-// Assume the mutex is held by the caller.
+// Unlock mutex and suspend for at most the specified number of ticks (or
+// forever if 0). Assume the mutex is held by the caller.
 // It is too expensive to do run-time integrity checks on this processor.
-void cond_wait(cond_t *c, mutex_t *m) {
+int8_t cond__suspend(cond_t *c, mutex_t *m, uint16_t ticks) {
   uint8_t sreg;
+  int8_t rv;
 
-  sreg = SREG;
-  cli();
+  TASK__ENTER(sreg);
 
   // Unlocking and suspending must happen atomically.
   // If it doesn't, a race could cause a cond_{signal,broadcast} from another
   // task holding the lock before this task has been suspended.
-  mutex_unlock(m);
+  // For the same reason this may not yield to the task that takes the lock.
+  mutex__unlock(m);
 
   // Suspend task until woken up through cond_{signal,broadcast}.
-  task_suspend(&c->waiting);
+  rv = task__suspend(&c->waiting, ticks);
 
   // Task may be interrupted again.
-  SREG = sreg;
+  TASK__LEAVE(sreg);
+
+  return rv;
+}
 
-  // Reacquire mutex.
+// Wait for at most the specified number of ticks (or forever if 0).
+static int8_t cond__wait(cond_t *c, mutex_t *m, uint16_t ticks) {
+  int8_t rv = cond__suspend(c, m, ticks);
+
+  // Reacquire mutex, also if the wait timed out.
   mutex_lock(m);
+
+  return rv;
+}
+
+void cond_wait(cond_t *c, mutex_t *m) {
+  cond__wait(c, m, 0);
+}
+
+int8_t cond_wait_timeout(cond_t *c, mutex_t *m, uint16_t ms) {
+  return cond__wait(c, m, TASK_TIMEOUT_TICKS(ms));
 }
 
 void cond_signal(cond_t *c) {
@@ -34,18 +53,28 @@ void cond_signal(cond_t *c) {
   QUEUE *q;
   task_t *t;
 
-  sreg = SREG;
-  cli();
+  TASK__ENTER(sreg);
 
-  // Wake up first waiting task (FIFO order).
+  // Wake up first waiting task (highest priority first, then FIFO order).
   if (!QUEUE_EMPTY(&c->waiting)) {
     q = QUEUE_HEAD(&c->waiting);
     t = QUEUE_DATA(q, task_t, member);
-    QUEUE_REMOVE(q);
     task_wakeup(t);
+
+#if TASK_HANDOFF
+    // Switch straight to the woken task. If the mutex it needs is likely held
+    // by this task, do so when this task no longer holds any mutex. A timer
+    // function or TASK_ISR handler holds none, whatever the task it
+    // interrupted holds.
+    if (task__in_task() && task_current()->mutexes) {
+      task_current()->handoff = t;
+    } else {
+      task_yield_to(t);
+    }
+#endif
   }
 
-  SREG = sreg;
+  TASK__LEAVE(sreg);
 }
 
 void cond_broadcast(cond_t *c) {
@@ -53,16 +82,14 @@ void cond_broadcast(cond_t *c) {
   QUEUE *q;
   task_t *t;
 
-  sreg = SREG;
-  cli();
+  TASK__ENTER(sreg);
 
   // Wake up all waiting tasks.
   while (!QUEUE_EMPTY(&c->waiting)) {
     q = QUEUE_HEAD(&c->waiting);
     t = QUEUE_DATA(q, task_t, member);
-    QUEUE_REMOVE(q);
     task_wakeup(t);
   }
 
-  SREG = sreg;
+  TASK__LEAVE(sreg);
 }
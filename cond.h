@@ -13,8 +13,42 @@ void cond_init(cond_t *c);
 
 void cond_wait(cond_t *c, mutex_t *m);
 
+// Wait for at most the specified number of milliseconds.
+// The mutex is reacquired in either case.
+// Returns 0 if signaled, or -1 if the wait timed out.
+int8_t cond_wait_timeout(cond_t *c, mutex_t *m, uint16_t ms);
+
+// Wake up the first waiting task. With TASK_HANDOFF, switch to it right away
+// like mutex_unlock does, or when the last mutex is unlocked if this task
+// holds any. From a timer function or a TASK_ISR handler, switch to it when
+// that returns.
 void cond_signal(cond_t *c);
 
 void cond_broadcast(cond_t *c);
 
+// Unlock mutex and suspend task until signaled, without reacquiring the
+// mutex. Used by cond_wait and TASK_CO_COND_WAIT.
+int8_t cond__suspend(cond_t *c, mutex_t *m, uint16_t ticks);
+
+#if TASK_COROUTINES
+// Wait from a coroutine (see task.h), for at most ms milliseconds (or
+// forever if 0), and store 0 in rv if signaled or -1 if it timed out. When
+// resumed after the wait, it locks the mutex again like TASK_CO_MUTEX_LOCK.
+// The mutex is never held on resume, so it holds it once it gets past here.
+#define TASK_CO_COND_WAIT(co, c, m, ms, rv)                                   \
+  do {                                                                        \
+    cond__suspend(c, m, (ms) ? TASK_TIMEOUT_TICKS(ms) : 0);                   \
+    (co)->lc = __LINE__;                                                      \
+    return TASK_CO_WAITING;                                                   \
+    case __LINE__:                                                            \
+    if ((m)->owner != task_current()) {                                       \
+      (rv) = (task_current()->flags & TASK_FLAG_TIMEOUT) ? -1 : 0;            \
+      mutex_lock(m);                                                          \
+      if ((m)->owner != task_current()) {                                     \
+        return TASK_CO_WAITING;                                               \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
+#endif
+
 #endif
@@ -32,29 +32,14 @@ static void lcd_send(mode_t m, uint8_t b) {
   PORTB &= 0b11110000;
 }
 
-static void lcd_yield_usec(int16_t usec) {
-  uint16_t t1;
-  uint16_t t2;
-  uint16_t dt;
+// Yield for at least the specified number of microseconds.
+static void lcd_yield_usec(uint16_t usec) {
+  uint32_t t1 = task_counts();
 
-  t1 = task_usec();
-  for (;;) {
+  // Counts may increment right after t1 was taken, so wait for one more.
+  do {
     task_yield();
-    t2 = task_usec();
-
-    if (t2 > t1) {
-      dt = t2 - t1;
-    } else {
-      dt = t2 + (UINT16_MAX - t1) + 1;
-    }
-
-    if (dt >= usec) {
-      break;
-    }
-
-    usec -= dt;
-    t1 = t2;
-  }
+  } while (task_counts() - t1 <= US_TO_COUNTS(usec + US_PER_COUNT - 1));
 }
 
 void lcd_init(void) {
@@ -50,24 +50,28 @@ static uint8_t bit = 0;
 // Code accumulator.
 static uint16_t code = 0;
 
-// Last interrupt trigger.
-static uint16_t prev_us = 0;
+// Last interrupt trigger (see task_counts).
+static uint32_t prev = 0;
 
 // Most recent delay duration.
 static uint16_t delay_us = 0;
 
-ISR(PCINT0_vect) {
-  uint16_t now_us, diff_us, pulse_us;
+TASK_ISR(PCINT0_vect) {
+  uint32_t now, diff;
+  uint16_t diff_us, pulse_us;
 
-  now_us = task_us();
-  if (prev_us < now_us) {
-    diff_us = now_us - prev_us;
+  now = task_counts();
+  diff = now - prev;
+
+  // Long delays (between codes) saturate.
+  if (diff > US_TO_COUNTS(UINT16_MAX)) {
+    diff_us = UINT16_MAX;
   } else {
-    diff_us = now_us + (UINT16_MAX - prev_us);
+    diff_us = COUNTS_TO_US(diff);
   }
 
   // Store current time for next edge.
-  prev_us = now_us;
+  prev = now;
 
   // Pin flipped to state for pulse start; store diff as delay time.
   if ((PINB & _BV(PINB0)) == _SIRC_PULSE_START) {
@@ -105,13 +109,17 @@ ISR(PCINT0_vect) {
     return;
   }
 
-  // Wake up task after receiving enough bits.
+  // Notify task after receiving enough bits.
   if (bit == BITS) {
     sirc__disable();
-    task_wakeup(task);
+    task_notify(task, _SIRC_NOTIFY);
 
     // Reset.
     bit = 0;
+
+#if TASK_ISR_YIELD
+    task_yield_from_isr();
+#endif
   } else {
     bit++;
   }
@@ -119,8 +127,34 @@ ISR(PCINT0_vect) {
 
 // Block until code is read.
 uint16_t sirc_read() {
-  sirc__enable();
   task = task_current();
-  task_suspend(NULL);
+  task_notify_take(_SIRC_NOTIFY);
+  sirc__enable();
+  task_notify_wait(_SIRC_NOTIFY, TASK_NOTIFY_ANY);
   return code;
 }
+
+// Block until code is read or the timeout expires.
+int8_t sirc_read_timeout(uint16_t *c, uint16_t ms) {
+  uint8_t sreg = SREG;
+  int8_t rv;
+
+  cli();
+
+  task = task_current();
+  task_notify_take(_SIRC_NOTIFY);
+  sirc__enable();
+  rv = task_notify_wait_timeout(_SIRC_NOTIFY, TASK_NOTIFY_ANY, ms) ? 0 : -1;
+
+  if (rv < 0) {
+    // Stop decoding and drop a partially received code.
+    sirc__disable();
+    bit = 0;
+  } else {
+    *c = code;
+  }
+
+  SREG = sreg;
+
+  return rv;
+}
@@ -68,6 +68,11 @@
 #define _SIRC_DELAY_ERROR_US 200
 #endif
 
+// Task notification bit used by the decoder (see task_notify).
+#ifndef _SIRC_NOTIFY
+#define _SIRC_NOTIFY 0x08
+#endif
+
 // Number of bits to capture.
 #define BITS 12
 
@@ -75,4 +80,8 @@ void sirc_init();
 
 uint16_t sirc_read();
 
+// Read code into c, waiting for at most the specified number of milliseconds.
+// Returns 0 if a code was read, or -1 if the wait timed out.
+int8_t sirc_read_timeout(uint16_t *c, uint16_t ms);
+
 #endif
@@ -0,0 +1,95 @@
+#include <avr/io.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "task.h"
+#include "mutex.h"
+#include "cond.h"
+#include "uart.h"
+
+// Runs a couple dozen state machines as coroutines, which take a few bytes
+// each instead of a stack. Every sensor samples at its own rate and adds to a
+// shared total, and the reporter writes the total to the UART when all of
+// them sampled a number of times.
+
+#define SENSORS 24
+#define SAMPLES 4
+
+struct sensor_s {
+  task_co_t co;
+  uint8_t id;
+  uint8_t n;
+};
+
+struct reporter_s {
+  task_co_t co;
+  int8_t rv;
+  char buf[32];
+  uint8_t len;
+};
+
+struct sensor_s sensors[SENSORS];
+struct reporter_s reporter;
+
+mutex_t lock;
+cond_t done;
+uint16_t total = 0;
+uint8_t finished = 0;
+
+uint8_t sensor(void *data) {
+  struct sensor_s *s = data;
+
+  TASK_CO_BEGIN(&s->co);
+
+  for (s->n = 0; s->n < SAMPLES; s->n++) {
+    TASK_CO_SLEEP(&s->co, 10 * (s->id + 1));
+
+    TASK_CO_MUTEX_LOCK(&s->co, &lock);
+    total += s->id;
+    if (s->n == SAMPLES - 1 && ++finished == SENSORS) {
+      cond_signal(&done);
+    }
+    mutex_unlock(&lock);
+  }
+
+  TASK_CO_END(&s->co);
+}
+
+uint8_t report(void *data) {
+  struct reporter_s *r = data;
+
+  TASK_CO_BEGIN(&r->co);
+
+  TASK_CO_MUTEX_LOCK(&r->co, &lock);
+  while (finished < SENSORS) {
+    TASK_CO_COND_WAIT(&r->co, &done, &lock, 0, r->rv);
+  }
+  r->len = snprintf(r->buf, sizeof(r->buf), "total: %u\r\n", total);
+  mutex_unlock(&lock);
+
+  TASK_CO_UART_WRITE(&r->co, r->buf, r->len);
+
+  TASK_CO_END(&r->co);
+}
+
+int main() {
+  uint8_t i;
+
+  uart_init(16, 1);
+
+  task_init();
+
+  mutex_init(&lock);
+  cond_init(&done);
+
+  for (i = 0; i < SENSORS; i++) {
+    sensors[i].id = i;
+    task_create_coroutine(sensor, &sensors[i]);
+  }
+
+  task_create_coroutine(report, &reporter);
+
+  task_start();
+
+  return 0; // Never reached
+}
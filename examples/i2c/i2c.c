@@ -58,17 +58,12 @@ void hmc5883l_measure(FILE *uart) {
 void hmc5883l_task(void *unused) {
   FILE uart = FDEV_SETUP_STREAM(uart_putc, uart_getc, _FDEV_SETUP_RW);
 
-  while (1) {
-    uint16_t t1, t2, msec;
+  // Space calls to "hmc5883l_measure" 100ms apart.
+  task_set_period(task_current(), 100);
 
-    t1 = task_msec();
+  while (1) {
     hmc5883l_measure(&uart);
-    t2 = task_msec();
-
-    // This subtraction underflows if t1 > t2, but yields the right result.
-    // Use measured time to space calls to "hmc5883l_measure" 100ms apart.
-    msec = t2 - t1;
-    task_sleep(100 - msec);
+    task_wait_period();
   }
 }
 
@@ -19,7 +19,7 @@ mutex_t m;
 void delay_task(void *data) {
   while (1) {
     mutex_lock(&m);
-    delay_ms = (uint16_t) data;
+    delay_ms = (uintptr_t) data;
     task_sleep(1000);
     mutex_unlock(&m);
   }
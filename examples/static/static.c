@@ -0,0 +1,46 @@
+#include <avr/io.h>
+#include <stddef.h>
+
+#include "task.h"
+
+// The blink example with tasks declared at compile time. The task structs
+// and stacks are part of the program's RAM usage as reported by avr-size,
+// and task_init starts the tasks.
+
+volatile uint8_t delay_ms = 0;
+
+void blink_task(void *unused) {
+  while (1) {
+    task_sleep(delay_ms);
+    PORTB ^= _BV(PB5);
+  }
+}
+
+void delay_task(void *unused) {
+  while (1) {
+    delay_ms = 50;
+    task_sleep(1000);
+    delay_ms = 200;
+    task_sleep(1000);
+  }
+}
+
+TASK_STATIC(blink, 96);
+TASK_STATIC(delay, 96);
+
+TASK_STATIC_TABLE = {
+  TASK_STATIC_ENTRY(blink, blink_task, NULL, TASK_PRIORITY_DEFAULT),
+  TASK_STATIC_ENTRY(delay, delay_task, NULL, TASK_PRIORITY_DEFAULT),
+  TASK_STATIC_END,
+};
+
+int main() {
+  // PB5 (pin 13) is an output pin
+  DDRB |= _BV(PB5);
+
+  task_init();
+
+  task_start();
+
+  return 0; // Never reached
+}
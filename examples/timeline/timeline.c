@@ -0,0 +1,60 @@
+#include <avr/io.h>
+#include <stddef.h>
+
+#include "task.h"
+#include "mutex.h"
+#include "trace.h"
+#include "uart.h"
+
+// Records what the tasks below do, and writes the trace to the UART once per
+// second. Convert the output with tools/trace2json.py to view the timeline.
+
+mutex_t lock;
+
+volatile uint16_t counter = 0;
+
+// Holds the lock for a while, making the blink task wait for it.
+void count_task(void *unused) {
+  while (1) {
+    mutex_lock(&lock);
+    counter++;
+    task_sleep(30);
+    mutex_unlock(&lock);
+    task_sleep(20);
+  }
+}
+
+void blink_task(void *unused) {
+  while (1) {
+    task_sleep(100);
+    mutex_lock(&lock);
+    PORTB ^= _BV(PB5);
+    mutex_unlock(&lock);
+  }
+}
+
+void dump_task(void *unused) {
+  while (1) {
+    task_sleep(1000);
+    trace_dump();
+  }
+}
+
+int main() {
+  // PB5 (pin 13) is an output pin
+  DDRB |= _BV(PB5);
+
+  // 115200 for 16MHz clock
+  uart_init(16, 1);
+
+  task_init();
+  mutex_init(&lock);
+
+  task_create(count_task, NULL);
+  task_create_ex(blink_task, NULL, 96);
+  task_create_priority(dump_task, NULL, TASK_PRIORITY_MAX);
+
+  task_start();
+
+  return 0; // Never reached
+}
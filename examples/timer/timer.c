@@ -0,0 +1,49 @@
+#include <avr/io.h>
+#include <stddef.h>
+
+#include "task.h"
+
+// Blinks the LEDs connected to pin 13 and pin 12 from software timers, at a
+// rate controlled by a task. The timers cost a few bytes each instead of a
+// task stack.
+
+task_timer_t fast;
+task_timer_t slow;
+task_timer_t pulse;
+
+void toggle(void *data) {
+  PORTB ^= (uint8_t)(uintptr_t)data;
+}
+
+// Turn on pin 12 for a short pulse on every expiry of the slow timer.
+void slow_expired(void *unused) {
+  PORTB |= _BV(PB4);
+  task_timer_start(&pulse, 50, 0);
+}
+
+void rate_task(void *unused) {
+  while (1) {
+    task_timer_start(&fast, 0, 50);
+    task_sleep(1000);
+    task_timer_start(&fast, 0, 200);
+    task_sleep(1000);
+  }
+}
+
+int main() {
+  // PB5 (pin 13) and PB4 (pin 12) are output pins
+  DDRB |= _BV(PB5) | _BV(PB4);
+
+  task_init();
+
+  task_timer_init(&fast, toggle, (void *)_BV(PB5));
+  task_timer_init(&slow, slow_expired, NULL);
+  task_timer_init(&pulse, toggle, (void *)_BV(PB4));
+  task_timer_start(&slow, 500, 500);
+
+  task_create(rate_task, NULL);
+
+  task_start();
+
+  return 0; // Never reached
+}
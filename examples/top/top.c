@@ -0,0 +1,84 @@
+#include <avr/io.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "task.h"
+#include "uart.h"
+
+#define MAX_TASKS 8
+
+volatile uint32_t counter = 0;
+
+void busy_task(void *unused) {
+  while (1) {
+    counter++;
+  }
+}
+
+void blink_task(void *unused) {
+  while (1) {
+    task_sleep(100);
+    PORTB ^= _BV(PB5);
+  }
+}
+
+// Print share of CPU time per task since the previous report.
+void top_task(void *unused) {
+  FILE uart = FDEV_SETUP_STREAM(uart_putc, uart_getc, _FDEV_SETUP_RW);
+  static task_stat_t prev[MAX_TASKS];
+  static task_stat_t stats[MAX_TASKS];
+  task_stats_t prev_sys = { 0 };
+  task_stats_t sys;
+  uint32_t total;
+  uint32_t dt;
+  uint8_t i, n;
+
+  while (1) {
+    task_sleep(1000);
+
+    n = task_stats(&sys, stats, MAX_TASKS);
+    if (n > MAX_TASKS) {
+      n = MAX_TASKS;
+    }
+
+    total = sys.idle - prev_sys.idle;
+    for (i = 0; i < n; i++) {
+      total += stats[i].runtime - prev[i].runtime;
+    }
+
+    fprintf(&uart, "switches: %u, wakeups: %u, preemptions: %u\r\n",
+        sys.switches - prev_sys.switches,
+        sys.wakeups - prev_sys.wakeups,
+        sys.preemptions - prev_sys.preemptions);
+
+    for (i = 0; i < n; i++) {
+      dt = stats[i].runtime - prev[i].runtime;
+      fprintf(&uart, "task %p: state %u, prio %u, %3u%%\r\n",
+          stats[i].task, stats[i].state, stats[i].priority,
+          (uint16_t)((dt * 100) / total));
+      prev[i] = stats[i];
+    }
+
+    dt = sys.idle - prev_sys.idle;
+    fprintf(&uart, "idle: %3u%%\r\n\r\n", (uint16_t)((dt * 100) / total));
+    prev_sys = sys;
+  }
+}
+
+int main() {
+  // PB5 (pin 13) is an output pin
+  DDRB |= _BV(PB5);
+
+  // 115200 for 16MHz clock
+  uart_init(16, 1);
+
+  task_init();
+
+  task_create_priority(busy_task, NULL, TASK_PRIORITY_MIN);
+  task_create_ex(blink_task, NULL, 96);
+  task_create_priority(top_task, NULL, TASK_PRIORITY_MAX);
+
+  task_start();
+
+  return 0; // Never reached
+}
@@ -0,0 +1,30 @@
+#ifndef _HOST_AVR_INTERRUPT_H
+#define _HOST_AVR_INTERRUPT_H
+
+// Host replacement for <avr/interrupt.h>.
+//
+// The Global Interrupt Enable bit is emulated in SREG. Interrupt handlers are
+// regular functions named after their vector. They run when the tick fires
+// (TIMER0_COMPA_vect) or when a simulation raises them with host_interrupt.
+
+#include <avr/io.h>
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define cli() host__cli()
+#define sei() host__sei()
+
+void host__cli(void);
+void host__sei(void);
+
+// Run interrupt handler as if the corresponding interrupt fired.
+// The handler runs with interrupts disabled, on the stack of the current task
+// (or the scheduler), exactly like on the AVR. If interrupts are disabled
+// this function must not be called; the simulation should retry later.
+void host_interrupt(void (*vector)(void));
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _HOST_AVR_IO_H
+#define _HOST_AVR_IO_H
+
+// Host replacement for <avr/io.h>.
+//
+// I/O registers are plain variables (defined in host/port.h). Bits that only
+// exist in registers are emulated where the kernel relies on them: the
+// Global Interrupt Enable bit in SREG (see host/avr/interrupt.h) and the
+// Output Compare Match A interrupt enable bit in TIMSK0, which starts the
+// tick. Everything else is just memory that can be inspected or poked by a
+// simulation.
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define HOST_REGISTERS(R) \
+  R(SREG) R(SMCR) \
+  R(TCCR0A) R(TCCR0B) R(TCNT0) R(OCR0A) R(OCR0B) R(TIMSK0) R(TIFR0) \
+  R(UCSR0A) R(UCSR0B) R(UCSR0C) R(UDR0) \
+  R(TWBR) R(TWSR) R(TWAR) R(TWDR) R(TWCR) \
+  R(PINB) R(DDRB) R(PORTB) R(PINC) R(DDRC) R(PORTC) R(PIND) R(DDRD) R(PORTD) \
+  R(PCICR) R(PCMSK0) R(PCMSK1) R(PCMSK2)
+
+#define HOST_REGISTER_DECLARE(name) extern volatile uint8_t name;
+HOST_REGISTERS(HOST_REGISTER_DECLARE)
+
+extern volatile uint16_t UBRR0;
+
+// SREG
+#define SREG_I 7
+
+// SMCR
+#define SE 0
+
+// TCCR0A
+#define WGM01 1
+#define WGM00 0
+
+// TCCR0B
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+
+// TIMSK0
+#define OCIE0B 2
+#define OCIE0A 1
+#define TOIE0 0
+
+// TIFR0
+#define OCF0B 2
+#define OCF0A 1
+#define TOV0 0
+
+// UCSR0A
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define MPCM0 0
+
+// UCSR0B
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ02 2
+#define RXB80 1
+#define TXB80 0
+
+// UCSR0C
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01 5
+#define UPM00 4
+#define USBS0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#define UCPOL0 0
+
+// TWCR
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+// TWSR
+#define TWPS1 1
+#define TWPS0 0
+
+// PCICR
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+
+// Port pins (identical bit numbers for PORTx, DDRx and PINx).
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PORTB0 0
+#define PORTB5 5
+#define DDB0 0
+#define DDB5 5
+#define PINB0 0
+#define PINB5 5
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PCINT0 0
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _HOST_AVR_PGMSPACE_H
+#define _HOST_AVR_PGMSPACE_H
+
+// Host replacement for <avr/pgmspace.h>.
+// There is only one address space.
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define memcpy_P(dst, src, n) memcpy(dst, src, n)
+
+#endif
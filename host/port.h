@@ -0,0 +1,273 @@
+#ifndef _HOST_PORT_H
+#define _HOST_PORT_H
+
+// Host port of the task kernel (TASK_HOST), only included by task.c.
+// Replaces the AVR context switching code, tick interrupt and idle sleep.
+//
+// Every task runs on a host stack of TASK_HOST_STACK_SIZE bytes and is
+// resumed from a ucontext_t. The task's sp field points to this context
+// instead of into its stack. Blocks are still allocated from the stack region,
+// so task creation succeeds or fails exactly like it does on the AVR.
+//
+// The tick is driven by a virtual clock by default: whenever the scheduler
+// goes idle, the next tick fires immediately. Sleeping takes no time and runs
+// are deterministic, but tasks are never preempted by the tick. With
+// TASK_HOST_TIMER, the tick fires every MS_PER_TICK of real time from
+// SIGALRM instead, and preempts tasks like on the AVR.
+//
+// The simulation exits when the number of ticks in the TASK_HOST_TICKS
+// environment variable have passed, or when no task is runnable or sleeping.
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#if TASK_TICKLESS
+#error "TASK_TICKLESS is not supported by the host port"
+#endif
+
+#ifndef TASK_HOST_STACK_SIZE
+#define TASK_HOST_STACK_SIZE 0x10000
+#endif
+
+typedef struct host_context_s host_context_t;
+
+struct host_context_s {
+  ucontext_t uc;
+  void *key; // Stack pointer of the block this context belongs to.
+  task_fn fn;
+  void *data;
+  host_context_t *next;
+  uint8_t stack[TASK_HOST_STACK_SIZE];
+};
+
+#define HOST_REGISTER_DEFINE(name) volatile uint8_t name;
+HOST_REGISTERS(HOST_REGISTER_DEFINE)
+
+volatile uint16_t UBRR0;
+
+static void task__scheduler(void);
+static void task__tick(void);
+static uint8_t task__preempt(void);
+
+void TIMER0_COMPA_vect(void);
+
+// Contexts of all task blocks, reused with the block.
+static host_context_t *_host__contexts = 0;
+
+// Context the scheduler is started from.
+static ucontext_t _host__scheduler;
+static uint8_t _host__scheduler_stack[TASK_HOST_STACK_SIZE];
+
+// Exit after this many ticks (0 means never).
+static uint32_t _host__tick_limit = 0;
+
+// Set if the tick fired while interrupts were disabled.
+static volatile sig_atomic_t _host__tick_pending = 0;
+
+void host__cli(void) {
+  SREG &= ~_BV(SREG_I);
+}
+
+void host__sei(void) {
+  SREG |= _BV(SREG_I);
+
+  if (_host__tick_pending) {
+    _host__tick_pending = 0;
+    host_interrupt(TIMER0_COMPA_vect);
+  }
+}
+
+void host_interrupt(void (*vector)(void)) {
+  uint8_t sreg = SREG;
+
+  SREG = sreg & ~_BV(SREG_I);
+  vector();
+  SREG = sreg;
+}
+
+// Save context of current task and start the scheduler from the top, on its
+// own stack. Returns when the task is resumed.
+static void task__host_switch(host_context_t *c) {
+  makecontext(&_host__scheduler, task__scheduler, 0);
+  swapcontext(&c->uc, &_host__scheduler);
+}
+
+static void task__jmp_scheduler(void) {
+  makecontext(&_host__scheduler, task__scheduler, 0);
+  setcontext(&_host__scheduler);
+}
+
+static void task__pop(void) {
+  host_context_t *c = _task__current->sp;
+
+  setcontext(&c->uc);
+}
+
+// Entry point of every task.
+static void task__host_entry(void) {
+  host_context_t *c = _task__current->sp;
+
+  // Start task with interrupts enabled.
+  sei();
+
+  c->fn(c->data);
+
+  task_exit();
+}
+
+// Internal task initializer.
+// Returns the context to resume the task from.
+static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
+  host_context_t *c;
+
+  for (c = _host__contexts; c != 0; c = c->next) {
+    if (c->key == sp) {
+      break;
+    }
+  }
+
+  if (c == 0) {
+    c = malloc(sizeof(*c));
+    if (c == 0) {
+      abort();
+    }
+
+    c->key = sp;
+    c->next = _host__contexts;
+    _host__contexts = c;
+  }
+
+  c->fn = fn;
+  c->data = data;
+
+  getcontext(&c->uc);
+  c->uc.uc_stack.ss_sp = c->stack;
+  c->uc.uc_stack.ss_size = sizeof(c->stack);
+  c->uc.uc_link = 0;
+  sigemptyset(&c->uc.uc_sigmask);
+  makecontext(&c->uc, task__host_entry, 0);
+
+  return c;
+}
+
+// Tick interrupt. Like on the AVR, the interrupted task is switched out and
+// the scheduler runs from the top. When the task is resumed, the handler
+// returns to where the task was interrupted.
+ISR(TIMER0_COMPA_vect) {
+  task__tick();
+
+  if (_host__tick_limit != 0 && _task__ticks >= _host__tick_limit) {
+    exit(0);
+  }
+
+  // Return to the interrupted task if it may continue running.
+  if (!task__preempt()) {
+    return;
+  }
+
+  if (_task__current == 0) {
+    // Interrupted the idle scheduler.
+    task__jmp_scheduler();
+  }
+
+  task__host_switch(_task__current->sp);
+}
+
+#if TASK_HOST_TIMER
+static void task__host_signal(int sig) {
+  if ((TIMSK0 & _BV(OCIE0A)) == 0) {
+    return;
+  }
+
+  if ((SREG & _BV(SREG_I)) == 0) {
+    _host__tick_pending = 1;
+    return;
+  }
+
+  host_interrupt(TIMER0_COMPA_vect);
+}
+#endif
+
+static void task__setup_timer(void) {
+  const char *ticks = getenv("TASK_HOST_TICKS");
+
+  if (ticks != 0) {
+    _host__tick_limit = strtoul(ticks, 0, 10);
+  }
+
+  getcontext(&_host__scheduler);
+  _host__scheduler.uc_stack.ss_sp = _host__scheduler_stack;
+  _host__scheduler.uc_stack.ss_size = sizeof(_host__scheduler_stack);
+  _host__scheduler.uc_link = 0;
+  sigemptyset(&_host__scheduler.uc_sigmask);
+
+#if TASK_HOST_TIMER
+  {
+    struct sigaction sa;
+    struct itimerval it;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = task__host_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, 0);
+
+    // The handler ignores the signal until task_start enables the interrupt.
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = US_PER_TICK;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, 0);
+  }
+#endif
+}
+
+// Wait for the next tick with interrupts enabled.
+// Called by the scheduler with interrupts disabled. Only returns if another
+// interrupt than the tick woke up the processor, which cannot happen here.
+static void task__host_idle(void) {
+#if TASK_HOST_TIMER
+  sigset_t mask;
+#endif
+
+  // Nothing will ever happen.
+  if (QUEUE_EMPTY(&_tasks__sleeping)) {
+    exit(0);
+  }
+
+#if TASK_HOST_TIMER
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGALRM);
+  sigprocmask(SIG_BLOCK, &mask, 0);
+
+  SREG |= _BV(SREG_I);
+  if (_host__tick_pending) {
+    _host__tick_pending = 0;
+    host_interrupt(TIMER0_COMPA_vect);
+  }
+
+  sigemptyset(&mask);
+  for (;;) {
+    sigsuspend(&mask);
+  }
+#else
+  SREG |= _BV(SREG_I);
+  host_interrupt(TIMER0_COMPA_vect);
+#endif
+}
+
+// Yield execution to any other schedulable task.
+void task_yield(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+  task__host_switch(_task__current->sp);
+
+  // Restore status register, taking a tick that fired in the meantime.
+  SREG = sreg & ~_BV(SREG_I);
+  if (sreg & _BV(SREG_I)) {
+    sei();
+  }
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <avr/interrupt.h>
+
+#include "task.h"
+#include "mutex.h"
+#include "cond.h"
+
+// Self-checking scenarios for the host build, run by "make check".
+// Ticks are 2ms. With the virtual clock, the tick at which every task wakes up
+// is exact, so the checks below compare tick counts.
+
+static uint8_t failed = 0;
+static uint8_t done = 0;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      printf("%s:%d: check failed: %s (tick %lu)\n", __FILE__, __LINE__,      \
+          #cond, (unsigned long)task_ticks());                                \
+      failed = 1;                                                             \
+    }                                                                         \
+  } while (0)
+
+static mutex_t lock;
+
+static QUEUE waiting;
+
+static task_t *waiter;
+
+// Order in which tasks got the lock.
+static uint8_t order[4];
+static uint8_t order_len = 0;
+
+static cond_t cond;
+
+// Number of tasks woken up from cond.
+static uint8_t woken = 0;
+
+static void sleep_scenario(void) {
+  uint32_t start = task_ticks();
+
+  task_sleep(20);
+  CHECK(task_ticks() - start == 10);
+
+  // Less than a tick sleeps until the next tick.
+  start = task_ticks();
+  task_sleep(1);
+  CHECK(task_ticks() - start == 1);
+
+  start = task_ticks();
+  task_sleep_until(start + 7);
+  CHECK(task_ticks() - start == 7);
+}
+
+#if TASK_PERIODIC
+static void period_scenario(void) {
+  uint32_t start;
+  uint8_t i;
+
+  task_set_period(task_current(), 10);
+  start = task_ticks();
+
+  for (i = 1; i <= 4; i++) {
+    task_wait_period();
+    CHECK(task_ticks() - start == i * 5);
+  }
+
+  // Miss two releases, and stay in phase.
+  task_sleep(26);
+  task_wait_period();
+  CHECK(task_ticks() - start == 35);
+  CHECK(task_overruns(task_current()) == 2);
+
+  task_set_period(task_current(), 0);
+}
+#endif
+
+static void wakeup_task(void *unused) {
+  task_sleep(6);
+  task_wakeup(waiter);
+}
+
+static void hold_task(void *unused) {
+  mutex_lock(&lock);
+  task_sleep(40);
+  mutex_unlock(&lock);
+}
+
+static void timeout_scenario(void) {
+  uint32_t start;
+  task_t *t;
+
+  // Times out, and is no longer in the queue.
+  start = task_ticks();
+  CHECK(task_suspend_timeout(&waiting, 10) == -1);
+  CHECK(task_ticks() - start == 5);
+  CHECK(QUEUE_EMPTY(&waiting));
+
+  // Woken up before the timeout.
+  waiter = task_current();
+  t = task_create(wakeup_task, NULL);
+  start = task_ticks();
+  CHECK(task_suspend_timeout(&waiting, 10) == 0);
+  CHECK(task_ticks() - start == 3);
+  task_join(t);
+
+  // Mutex held by another task for longer than the timeout.
+  t = task_create(hold_task, NULL);
+  task_sleep(2);
+  start = task_ticks();
+  CHECK(mutex_lock_timeout(&lock, 10) == -1);
+  CHECK(task_ticks() - start == 5);
+  task_join(t);
+
+  CHECK(mutex_lock_timeout(&lock, 10) == 0);
+  mutex_unlock(&lock);
+}
+
+static void lock_task(void *data) {
+  mutex_lock(&lock);
+  order[order_len++] = (uintptr_t)data;
+  mutex_unlock(&lock);
+}
+
+static void mutex_scenario(void) {
+  task_t *t[4];
+  uint8_t i;
+
+  // Waiters get the lock by priority, and in order of arrival within a
+  // priority.
+  mutex_lock(&lock);
+  t[0] = task_create_priority(lock_task, (void *)1, TASK_PRIORITY_MIN);
+  t[1] = task_create_priority(lock_task, (void *)2, TASK_PRIORITY_DEFAULT);
+  t[2] = task_create_priority(lock_task, (void *)3, TASK_PRIORITY_MIN);
+  t[3] = task_create_priority(lock_task, (void *)4, TASK_PRIORITY_DEFAULT);
+  task_sleep(10);
+  mutex_unlock(&lock);
+
+  for (i = 0; i < 4; i++) {
+    task_join(t[i]);
+  }
+
+  CHECK(order_len == 4);
+  CHECK(order[0] == 2 && order[1] == 4 && order[2] == 1 && order[3] == 3);
+}
+
+static void cond_task(void *unused) {
+  mutex_lock(&lock);
+  cond_wait(&cond, &lock);
+  woken++;
+  mutex_unlock(&lock);
+}
+
+#if TASK_TIMERS
+static void broadcast_timer(void *unused) {
+  cond_broadcast(&cond);
+}
+#endif
+
+// Wake up waiting tasks with interrupts disabled, as interrupt handlers and
+// timer functions do.
+static void broadcast_scenario(void) {
+  task_t *t[2];
+#if TASK_TIMERS
+  task_timer_t timer;
+#endif
+
+  t[0] = task_create(cond_task, NULL);
+  t[1] = task_create(cond_task, NULL);
+  task_sleep(4);
+  cli();
+  cond_broadcast(&cond);
+  sei();
+  task_join(t[0]);
+  task_join(t[1]);
+  CHECK(woken == 2);
+
+#if TASK_TIMERS
+  t[0] = task_create(cond_task, NULL);
+  t[1] = task_create(cond_task, NULL);
+  task_timer_init(&timer, broadcast_timer, NULL);
+  task_timer_start(&timer, 4, 0);
+  task_join(t[0]);
+  task_join(t[1]);
+  CHECK(woken == 4);
+#endif
+}
+
+static void main_task(void *unused) {
+  printf("sleep\n");
+  sleep_scenario();
+#if TASK_PERIODIC
+  printf("period\n");
+  period_scenario();
+#endif
+  printf("timeout\n");
+  timeout_scenario();
+  printf("mutex\n");
+  mutex_scenario();
+  printf("broadcast\n");
+  broadcast_scenario();
+
+  printf("%s\n", failed ? "FAIL" : "PASS");
+  done = 1;
+  exit(failed);
+}
+
+// The simulation also exits when no task is left to run.
+static void check_done(void) {
+  if (!done) {
+    printf("stopped before all scenarios ran\nFAIL\n");
+    _exit(1);
+  }
+}
+
+int main() {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  atexit(check_done);
+
+  task_init();
+  mutex_init(&lock);
+  cond_init(&cond);
+  QUEUE_INIT(&waiting);
+
+  task_create_priority(main_task, NULL, TASK_PRIORITY_MAX);
+
+  task_start();
+
+  return 0; // Never reached
+}
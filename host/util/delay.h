@@ -0,0 +1,10 @@
+#ifndef _HOST_UTIL_DELAY_H
+#define _HOST_UTIL_DELAY_H
+
+// Host replacement for <util/delay.h>.
+// Busy waits take no time in simulation.
+
+#define _delay_us(us) ((void)(us))
+#define _delay_ms(ms) ((void)(ms))
+
+#endif
@@ -19,6 +19,9 @@ static task_t *i2c_task;
 // Current I2C operation.
 static struct i2c_op_s *i2c_op;
 
+// Ticks to wait for an operation to complete (0 waits forever).
+static uint16_t i2c_timeout = 0;
+
 // By default, the control register is set to:
 // - TWEA: Automatically send acknowledge bit in receive mode.
 // - TWEN: Enable the I2C system.
@@ -61,6 +64,10 @@ void i2c_init(void) {
   SREG = sreg;
 }
 
+void i2c_set_timeout(uint16_t ms) {
+  i2c_timeout = ms ? TASK_TIMEOUT_TICKS(ms) : 0;
+}
+
 void i2c_open(void) {
   // No-op for now.
 }
@@ -88,12 +95,22 @@ static int8_t i2c__io(uint8_t address, struct i2c_iovec_s *iov, uint8_t iovcnt)
   cli();
 
   i2c_task = task_current();
+  task_notify_take(I2C_NOTIFY);
   i2c_op = &op;
 
   // Transmit START to kickstart operation.
   TWCR = TWCR_START;
 
-  task_suspend(NULL);
+  if (task__notify_wait(I2C_NOTIFY, TASK_NOTIFY_ANY, i2c_timeout) == 0) {
+    // Abort operation. Disabling the TWI module releases the bus and stops
+    // the interrupt handler from touching the operation on this stack.
+    TWCR = 0;
+    TWCR = TWCR_DEFAULT & ~_BV(TWIE);
+    i2c_op = NULL;
+
+    SREG = sreg;
+    return -2;
+  }
 
   SREG = sreg;
 
@@ -138,7 +155,7 @@ int8_t i2c_write_to(uint8_t address, uint8_t reg, uint8_t *buf, uint8_t len) {
   return i2c_writev(address, (struct i2c_iovec_s *) &iov, 2);
 }
 
-ISR(TWI_vect, ISR_BLOCK) {
+TASK_ISR(TWI_vect) {
   uint8_t status;
 
   status = TW_STATUS;
@@ -291,6 +308,9 @@ done:
   //
   TWCR = TWCR_DEFAULT & ~_BV(TWIE);
 
-  task_wakeup(i2c_task);
+  task_notify(i2c_task, I2C_NOTIFY);
+#if TASK_ISR_YIELD
+  task_yield_from_isr();
+#endif
   return;
 }
@@ -5,6 +5,11 @@
 #define I2C_FREQ 100000
 #endif
 
+// Task notification bit used by the driver (see task_notify).
+#ifndef I2C_NOTIFY
+#define I2C_NOTIFY 0x04
+#endif
+
 struct i2c_iovec_s {
   uint8_t *base;
   uint8_t len;
@@ -12,6 +17,11 @@ struct i2c_iovec_s {
 
 void i2c_init(void);
 
+// Set timeout for I2C operations in milliseconds (0 waits forever, default).
+// Operations return -1 if the slave does not acknowledge, and -2 if they do
+// not complete in time, in which case the operation is aborted.
+void i2c_set_timeout(uint16_t ms);
+
 void i2c_open(void);
 
 void i2c_close(void);
@@ -1,47 +1,149 @@
 #include <avr/interrupt.h>
 
 #include "mutex.h"
+#include "trace.h"
+
+// Set priority of owner to the higher of its base priority and the priority of
+// the first task waiting for the mutex. Must be called between TASK__ENTER and
+// TASK__LEAVE.
+static void mutex__restore_priority(mutex_t *m, task_t *owner) {
+  uint8_t priority = owner->base_priority;
+  task_t *t;
+
+  if (!QUEUE_EMPTY(&m->waiting)) {
+    t = QUEUE_DATA(QUEUE_HEAD(&m->waiting), task_t, member);
+    if (t->priority > priority) {
+      priority = t->priority;
+    }
+  }
+
+  if (owner->priority != priority) {
+    task__set_effective_priority(owner, priority);
+  }
+}
 
 void mutex_init(mutex_t *m) {
   m->status = MUTEX_UNLOCKED;
+  m->owner = 0;
   QUEUE_INIT(&m->waiting);
 }
 
-void mutex_lock(mutex_t *m) {
+// Lock mutex, waiting for at most the specified number of ticks (or forever
+// if 0). Returns 0 if the lock was taken, or -1 if the wait timed out.
+static int8_t mutex__lock(mutex_t *m, uint16_t ticks) {
   uint8_t sreg;
+  task_t *self;
+  task_t *owner;
+  int8_t rv = 0;
+
+  TASK__ENTER(sreg);
 
-  sreg = SREG;
-  cli();
+  self = task_current();
 
   if (m->status == MUTEX_LOCKED) {
+    owner = m->owner;
+
+    TRACE(TRACE_MUTEX_WAIT, owner->id);
+
+    // Lend priority to the task holding the lock, so that it gets to run
+    // and release the lock before tasks with a lower priority than ours.
+    if (owner->priority < self->priority) {
+      task__set_effective_priority(owner, self->priority);
+    }
+
     // Lock is transferred to this task when it is woken up.
     // m->status will still be set to MUTEX_LOCKED, to avoid any other tasks
     // being scheduled before this one and grabbing the lock.
-    task_suspend(&m->waiting);
+    rv = task__suspend(&m->waiting, ticks);
+
+    // On timeout, take back the priority lent to the owner. Its priority can
+    // only be recomputed if this is the only mutex it holds; otherwise it
+    // keeps the boost until it releases all of them.
+    if (rv < 0 && m->owner == owner && owner->mutexes == 1) {
+      mutex__restore_priority(m, owner);
+    }
   } else {
     m->status = MUTEX_LOCKED;
+    m->owner = self;
+    self->mutexes++;
   }
 
-  SREG = sreg;
+  TASK__LEAVE(sreg);
+
+  return rv;
 }
 
-void mutex_unlock(mutex_t *m) {
+void mutex_lock(mutex_t *m) {
+  mutex__lock(m, 0);
+}
+
+int8_t mutex_lock_timeout(mutex_t *m, uint16_t ms) {
+  return mutex__lock(m, TASK_TIMEOUT_TICKS(ms));
+}
+
+task_t *mutex__unlock(mutex_t *m) {
   uint8_t sreg;
-  QUEUE *q;
+  task_t *self;
   task_t *t;
 
-  sreg = SREG;
-  cli();
+  TASK__ENTER(sreg);
+
+  self = m->owner;
+  self->mutexes--;
 
   if (QUEUE_EMPTY(&m->waiting)) {
     m->status = MUTEX_UNLOCKED;
+    m->owner = 0;
+    t = 0;
   } else {
-    // Wake up first waiting task to transfer lock
-    q = QUEUE_HEAD(&m->waiting);
-    t = QUEUE_DATA(q, task_t, member);
-    QUEUE_REMOVE(q);
+    // Wake up first waiting task to transfer lock.
+    // This is the waiting task with the highest priority.
+    t = QUEUE_DATA(QUEUE_HEAD(&m->waiting), task_t, member);
+    m->owner = t;
+    t->mutexes++;
     task_wakeup(t);
   }
 
-  SREG = sreg;
+  if (self->mutexes == 0) {
+    // Drop inherited priority when no more mutexes are held.
+    if (self->priority != self->base_priority) {
+      task__set_effective_priority(self, self->base_priority);
+    }
+
+#if TASK_HANDOFF
+    // Switch to a task signaled while the mutex was held (see cond_signal),
+    // unless the lock was transferred.
+    if (t == 0) {
+      t = self->handoff;
+    }
+    self->handoff = 0;
+#endif
+  }
+
+  TASK__LEAVE(sreg);
+
+  return t;
+}
+
+void mutex_unlock(mutex_t *m) {
+  uint8_t sreg;
+  task_t *t;
+
+  TASK__ENTER(sreg);
+
+  t = mutex__unlock(m);
+
+#if TASK_HANDOFF
+  // Run the new owner right away, also if it has the same priority.
+  if (t != 0) {
+    task_yield_to(t);
+  }
+#else
+  // Run the new owner right away if it has a higher priority.
+  if (t != 0 && t->priority > task_current()->priority) {
+    task_yield_to(t);
+  }
+#endif
+
+  TASK__LEAVE(sreg);
 }
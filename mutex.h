@@ -14,6 +14,19 @@
  * be locked by this task. The latter is necessary to prevent the task that
  * unlocked the mutex from immediately locking it again and thereby starving
  * other tasks waiting for access to the same protected resource.
+ *
+ * Waiting tasks are queued in order of priority, so the lock is always handed
+ * to the waiting task with the highest priority. A task that has to wait for a
+ * mutex lends its priority to the task holding it (priority inheritance),
+ * such that the holder cannot be kept from releasing the mutex by tasks with
+ * a priority between the two. The holder drops back to its own priority when
+ * it no longer holds any mutex. This is not transitive: if the holder itself
+ * is waiting for another mutex, the holder of that mutex is not boosted.
+ *
+ * With TASK_HANDOFF, 'mutex_unlock' switches straight to the task the lock is
+ * transferred to if its priority is at least that of the unlocking task
+ * (see task_yield_to), instead of only if it is higher. Tasks passing a lock
+ * back and forth then don't wait for other tasks of their priority to run.
  */
 
 #include "task.h"
@@ -25,6 +38,7 @@ typedef struct mutex_s mutex_t;
 
 struct mutex_s {
   unsigned status:1;
+  task_t *owner;
   QUEUE waiting;
 };
 
@@ -32,6 +46,30 @@ void mutex_init(mutex_t *mutex);
 
 void mutex_lock(mutex_t *mutex);
 
+// Lock mutex, waiting for at most the specified number of milliseconds.
+// Returns 0 if the lock was taken, or -1 if the wait timed out.
+int8_t mutex_lock_timeout(mutex_t *mutex, uint16_t ms);
+
 void mutex_unlock(mutex_t *mutex);
 
+#if TASK_COROUTINES
+// Lock mutex from a coroutine (see task.h). When the coroutine is resumed
+// after waiting, the lock has been transferred to it.
+#define TASK_CO_MUTEX_LOCK(co, m)                                             \
+  do {                                                                        \
+    mutex_lock(m);                                                            \
+    (co)->lc = __LINE__;                                                      \
+    case __LINE__:                                                            \
+    if ((m)->owner != task_current()) {                                       \
+      return TASK_CO_WAITING;                                                 \
+    }                                                                         \
+  } while (0)
+#endif
+
+// Unlock mutex without yielding to the task the lock is transferred to.
+// Returns this task, or NULL if the mutex was unlocked. With TASK_HANDOFF it
+// can also return a task that was signaled while the mutex was held.
+// Used by cond_wait to unlock and suspend atomically.
+task_t *mutex__unlock(mutex_t *mutex);
+
 #endif
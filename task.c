@@ -1,24 +1,176 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <string.h>
 
 #include "task.h"
+#include "trace.h"
+
+// Type of context frame a task can be resumed from.
+// The frame type is written and read from assembly (see task__push, task__pop
+// and task_yield) and must match the values used there.
+#define TASK_FRAME_FULL 0 // All registers (preempted by timer)
+#define TASK_FRAME_COOP 1 // Call-saved registers only (voluntary yield)
 
 // Pointer to current task.
 // May only be changed by schedule routine.
 static task_t *_task__current = 0;
 
-// Queue with runnable tasks.
+// Set if a task of equal or higher priority than the current task became
+// runnable since the current task was scheduled.
+static uint8_t _task__resched = 0;
+
+// Task to schedule next, ahead of other tasks of its priority (see
+// task_yield_to).
+static task_t *_task__yield_to = 0;
+
+#if TASK_LOCK
+// Scheduler lock depth of the running task (see task_lock).
+static uint8_t _task__lock = 0;
+
+// Ticks that passed while the scheduler was locked, and that the timeline has
+// yet to catch up with.
+static uint16_t _task__lock_ticks = 0;
+
+// Tasks woken up by interrupt handlers while the scheduler was locked, linked
+// through their lock_next field.
+static task_t *_task__lock_wakeups = 0;
+
+// Set if the tick would have preempted the task holding the scheduler lock.
+static uint8_t _task__lock_preempt = 0;
+#endif
+
+#if TASK_ISR_STACK && !TASK_HOST
+// Interrupt stack shared by all interrupt handlers (see TASK_ISR).
+uint8_t _task__isr_stack[TASK_ISR_STACK_SIZE];
+
+// Stack pointer of the interrupted task while on the interrupt stack.
+void *_task__isr_sp = 0;
+
+// Set if "task_yield_from_isr" was called on the interrupt stack.
+static uint8_t _task__isr_yield = 0;
+#endif
+
+// Queues with runnable tasks, one per priority level.
 // Holds tasks that may be scheduled immediately.
-static QUEUE _tasks__runnable;
+static QUEUE _tasks__runnable[TASK_PRIORITIES];
+
+// Bit N is set if _tasks__runnable[N] is not empty.
+static uint8_t _tasks__runnable_bitmap;
 
 // Queue with suspended tasks.
 // Holds tasks that called "task_suspend".
 static QUEUE _tasks__suspended;
 
-// Queue with sleeping tasks.
-// Holds tasks that called "task_sleep".
+// Queue with terminated tasks whose blocks can be reused.
+static QUEUE _tasks__free;
+
+// Queue with sleeping tasks (the timeline).
+// Holds tasks that called "task_sleep", ordered by wakeup time, as well as
+// tasks waiting with a timeout and software timers. The delay of every entry
+// is relative to the entry before it, such that only the delay of the first
+// entry has to be decremented on every tick.
 static QUEUE _tasks__sleeping;
 
+#if TASK_TIMERS
+// Queue with timers that expired and whose function is still to be called.
+// The delay of these timers holds the tick they expired at.
+static QUEUE _task__timers_due;
+
+// Set if the current task was switched out only to call timer functions.
+static uint8_t _task__timers_resume = 0;
+
+// Set while timer functions run on the scheduler stack.
+static uint8_t _task__timers_running = 0;
+#endif
+
+// Number of ticks since task_init.
+static uint32_t _task__ticks = 0;
+
+#if TASK_STACK_REGION_SIZE > 0
+// Region that task stacks (and task structs) are allocated from.
+// Being part of .bss, it cannot overlap with other variables or the heap.
+static uint8_t _task__stacks[TASK_STACK_REGION_SIZE];
+
+// Number of bytes allocated from the top of the stack region.
+static uint16_t _task__stacks_used = 0;
+#endif
+
+#if TASK_STATS
+// Linked list (through task_t.next) of all task blocks.
+static task_t *_tasks__all = 0;
+
+// System wide statistics.
+static task_stats_t _task__stats;
+
+// Clock (see task__clock) at the last switch.
+static uint16_t _task__stats_clock;
+#endif
+
+#if TASK_TRACE
+// Id of the most recently created task.
+static uint8_t _task__trace_id = 0;
+#endif
+
+#if TASK_TICKLESS
+// Number of ticks the current idle period spans, or 0 if not idle.
+static uint8_t _task__idle_ticks = 0;
+
+// Timer counts dropped when switching to the idle prescaler.
+static uint8_t _task__idle_residue;
+#endif
+
+// Return number of timer counts since the last tick that was accounted for,
+// including a tick interrupt that is pending (or the ticks of an idle period
+// that completed). Must be called with interrupts disabled.
+static uint16_t task__elapsed(void) {
+  uint16_t count = TCNT0;
+  uint8_t ticks = 0;
+
+#if TASK_TICKLESS
+  // Timer runs at the idle prescaler and the idle period may have completed.
+  if (_task__idle_ticks) {
+    if (TIFR0 & _BV(OCF0A)) {
+      count = TCNT0;
+      ticks = _task__idle_ticks;
+    }
+
+    count = count * IDLE_COUNT_SCALE + _task__idle_residue;
+    return ticks * COUNTS_PER_TICK + count;
+  }
+#endif
+
+  // Tick interrupt may be pending.
+  if (TIFR0 & _BV(OCF0A)) {
+    count = TCNT0;
+    ticks = 1;
+  }
+
+  return ticks * COUNTS_PER_TICK + count;
+}
+
+uint32_t task_ticks(void) {
+  uint8_t sreg = SREG;
+  uint32_t ticks;
+
+  cli();
+  ticks = _task__ticks + task__elapsed() / COUNTS_PER_TICK;
+  SREG = sreg;
+
+  return ticks;
+}
+
+uint32_t task_counts(void) {
+  uint8_t sreg = SREG;
+  uint32_t counts;
+
+  cli();
+  counts = _task__ticks * COUNTS_PER_TICK + task__elapsed();
+  SREG = sreg;
+
+  return counts;
+}
+
 #if TASK_COUNT_SEC
 static TASK_SEC_T _task_sec = 0;
 
@@ -26,7 +178,14 @@ static TASK_SEC_T _task_sec = 0;
 static uint16_t _task_sec_countdown;
 
 TASK_SEC_T task_sec(void) {
-  return _task_sec;
+  uint8_t sreg = SREG;
+  TASK_SEC_T t;
+
+  cli();
+  t = _task_sec;
+  SREG = sreg;
+
+  return t;
 }
 
 void task_set_sec(TASK_SEC_T t) {
@@ -43,7 +202,14 @@ void task_set_sec(TASK_SEC_T t) {
 static TASK_MSEC_T _task_msec = 0;
 
 TASK_MSEC_T task_msec(void) {
-  return _task_msec;
+  uint8_t sreg = SREG;
+  TASK_MSEC_T t;
+
+  cli();
+  t = _task_msec;
+  SREG = sreg;
+
+  return t;
 }
 
 void task_set_msec(TASK_MSEC_T t) {
@@ -59,7 +225,14 @@ void task_set_msec(TASK_MSEC_T t) {
 static TASK_USEC_T _task_usec = 0;
 
 TASK_USEC_T task_usec(void) {
-  return (_task_usec + (TCNT0 * US_PER_COUNT));
+  uint8_t sreg = SREG;
+  TASK_USEC_T t;
+
+  cli();
+  t = _task_usec + COUNTS_TO_US(task__elapsed());
+  SREG = sreg;
+
+  return t;
 }
 
 void task_set_usec(TASK_USEC_T t) {
@@ -71,6 +244,137 @@ void task_set_usec(TASK_USEC_T t) {
 }
 #endif // TASK_COUNT_USEC
 
+#if TASK_STATS || TASK_TRACE
+// Return number of timer counts since task_init, truncated to 16 bits.
+// Must be called with interrupts disabled.
+static uint16_t task__clock(void) {
+  return (uint16_t)_task__ticks * COUNTS_PER_TICK + task__elapsed();
+}
+#endif
+
+#if TASK_TRACE
+uint16_t task__trace_clock(void) {
+  return task__clock();
+}
+#endif
+
+// Index of the most significant bit set in a nibble.
+static const uint8_t task__msb[16] PROGMEM = {
+  0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+// Return highest priority that has runnable tasks.
+// Only valid if _tasks__runnable_bitmap is not zero.
+static uint8_t task__highest_priority(void) {
+  uint8_t b = _tasks__runnable_bitmap;
+
+  if (b & 0xf0) {
+    return 4 + pgm_read_byte(&task__msb[b >> 4]);
+  }
+
+  return pgm_read_byte(&task__msb[b]);
+}
+
+// Add task to the tail of the run queue for its priority.
+static void task__runnable_insert(task_t *t) {
+  QUEUE_INSERT_TAIL(&_tasks__runnable[t->priority], &t->member);
+  _tasks__runnable_bitmap |= _BV(t->priority);
+  t->state = TASK_STATE_RUNNABLE;
+
+  // Don't let the current task finish its quantum.
+  if (_task__current && t->priority >= _task__current->priority) {
+    _task__resched = 1;
+  }
+}
+
+// Remove task from the run queue for its priority.
+static void task__runnable_remove(task_t *t) {
+  QUEUE_REMOVE(&t->member);
+  if (QUEUE_EMPTY(&_tasks__runnable[t->priority])) {
+    _tasks__runnable_bitmap &= ~_BV(t->priority);
+  }
+}
+
+// Return task at the head of the run queue for the specified priority.
+// The run queue must not be empty.
+static task_t *task__runnable_head(uint8_t priority) {
+  return QUEUE_DATA(QUEUE_HEAD(&_tasks__runnable[priority]), task_t, member);
+}
+
+#if TASK_EDF
+// Return task after t in its run queue, or NULL if t is the tail.
+static task_t *task__runnable_next(task_t *t) {
+  QUEUE *q = QUEUE_NEXT(&t->member);
+
+  if (q == &_tasks__runnable[t->priority]) {
+    return 0;
+  }
+
+  return QUEUE_DATA(q, task_t, member);
+}
+#endif
+
+// Make head through t the new tail of its run queue, so that the task after t
+// is scheduled next.
+static void task__runnable_rotate(task_t *t) {
+  QUEUE_ROTATE(&_tasks__runnable[t->priority], &t->member);
+}
+
+// Insert task in wait queue, behind all tasks of equal or higher priority.
+static void task__wait_insert(QUEUE *h, task_t *t) {
+  QUEUE *q;
+
+  QUEUE_FOREACH(q, h) {
+    if (QUEUE_DATA(q, task_t, member)->priority < t->priority) {
+      break;
+    }
+  }
+
+  // Insert before q (or at the tail if q == h).
+  QUEUE_INSERT_TAIL(q, &t->member);
+}
+
+// Insert entry in timeline to expire after the specified number of ticks.
+// It is placed behind entries that expire at the same tick.
+static void task__sleep_insert(task_tnode_t *n, uint16_t ticks) {
+  QUEUE *q;
+  task_tnode_t *u;
+
+#if TASK_LOCK
+  // Expire relative to the timeline after it has caught up.
+  ticks += _task__lock_ticks;
+#endif
+
+  QUEUE_FOREACH(q, &_tasks__sleeping) {
+    u = QUEUE_DATA(q, task_tnode_t, link);
+    if (ticks < u->delay) {
+      u->delay -= ticks;
+      break;
+    }
+    ticks -= u->delay;
+  }
+
+  // Insert before q (or at the tail if q == &_tasks__sleeping).
+  n->delay = ticks;
+  QUEUE_INSERT_TAIL(q, &n->link);
+}
+
+// Remove entry from timeline.
+// Its remaining delay is added to the delay of the entry after it.
+static void task__sleep_remove(task_tnode_t *n) {
+  QUEUE *q = QUEUE_NEXT(&n->link);
+
+  if (q != &_tasks__sleeping) {
+    QUEUE_DATA(q, task_tnode_t, link)->delay += n->delay;
+  }
+
+  QUEUE_REMOVE(&n->link);
+  QUEUE_INIT(&n->link);
+}
+
+#if TASK_HOST
+#include "host/port.h"
+#else
 // Push a task's context onto its own stack.
 static inline void task__push(void) __attribute__ ((always_inline));
 static inline void task__push(void) {
@@ -151,6 +455,9 @@ static inline void task__push(void) {
     "in r0, 0x3e\n" // High
     "st z+, r0\n"
 
+    // Mark frame as full context (TASK_FRAME_FULL, r1 is zero)
+    "st z, r1\n"
+
   "3:\n"
   );
 }
@@ -167,6 +474,13 @@ static void task__pop(void) {
     "ld r0, x+\n"
     "out 0x3e, r0\n" // High
 
+    // Resume from cooperative frame if task yielded voluntarily
+    "ld r0, x\n"
+    "tst r0\n"
+    "breq 1f\n"
+    "jmp task_pop_coop\n"
+
+  "1:\n"
     // Restore general registers
     "pop r29\n"
     "pop r28\n"
@@ -236,6 +550,45 @@ static void task__pop(void) {
     "pop r0\n" // Restore the real r0
     "reti\n"
 
+    // Cooperative frame (see task_yield).
+    // Only the call-saved registers and the status register were saved.
+    // Return with interrupts enabled in the same way as above.
+  "task_pop_coop:\n"
+    "pop r29\n"
+    "pop r28\n"
+    "pop r17\n"
+    "pop r16\n"
+    "pop r15\n"
+    "pop r14\n"
+    "pop r13\n"
+    "pop r12\n"
+    "pop r11\n"
+    "pop r10\n"
+    "pop r9\n"
+    "pop r8\n"
+    "pop r7\n"
+    "pop r6\n"
+    "pop r5\n"
+    "pop r4\n"
+    "pop r3\n"
+    "pop r2\n"
+    "clr r1\n"
+
+    "pop r0\n"
+    "sbrs r0, 7\n" // Skip if bit in register set
+    "jmp task_pop_coop_ret\n"
+    "jmp task_pop_coop_reti\n"
+
+  "task_pop_coop_ret:\n"
+    "out 0x3f, r0\n" // Restore status register
+    "ret\n"
+
+  "task_pop_coop_reti:\n"
+    "clt\n" // Clear T in SREG
+    "bld r0, 7\n" // Bit load from T to r0 bit 7 (interrupt bit)
+    "out 0x3f, r0\n" // Restore status register (without interrupt bit set)
+    "reti\n"
+
   );
 }
 
@@ -258,6 +611,15 @@ static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
     "out 0x3d, %A1\n"
     "out 0x3e, %B1\n"
 
+    // Store location of task_exit as return address of the task body, such
+    // that the task terminates when the task function returns.
+    "push %A4\n"
+    "push %B4\n"
+#ifdef __AVR_3_BYTE_PC__
+    "clr __tmp_reg__\n"
+    "push __tmp_reg__\n"
+#endif
+
     // Store location of task body as return address, such that
     // executing "ret" after "context_restore" will jump to it.
     "push %A2\n"
@@ -326,251 +688,1735 @@ static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
     "out 0x3f, r18\n"
 
     : "=r" (result)
-    : "r" (sp), "r" (fn), "r" (data)
+    : "r" (sp), "r" (fn), "r" (data), "r" (task_exit)
     : "r18", "r19", "r26", "r27"
   );
 
   return result;
 }
+#endif // TASK_HOST
 
-// Creates a task for the specified function.
-task_t *task__internal_create(task_fn fn, void *data) {
-  static void *start = (void *)RAMEND;
-  void *sp;
+// Take block of a terminated task with a stack of at least the specified
+// size from the free list, or return NULL if there is none.
+// Must be called with interrupts disabled.
+static task_t *task__free_get(uint16_t stack_size) {
+  QUEUE *q;
   task_t *t;
 
-  // Should protect this against underflow.
-  start -= 0x100;
+  QUEUE_FOREACH(q, &_tasks__free) {
+    t = QUEUE_DATA(q, task_t, member);
+    if (t->stack_size >= stack_size) {
+      QUEUE_REMOVE(q);
+      return t;
+    }
+  }
 
-  // Stack grows down, don't overwrite first byte of task struct.
-  t = start - sizeof(task_t);
-  sp = (void *)t - 1;
+  return 0;
+}
 
-  t->sp = task__internal_initialize(sp, fn, data);
-  t->delay = 0;
-  QUEUE_INIT(&t->member);
+// Initialize task struct of block with the specified stack.
+static void task__init(task_t *t, uint8_t *stack, uint16_t stack_size) {
+#if TASK_STACK_CHECK
+  memset(stack, TASK_STACK_PAINT, stack_size);
+#endif
 
-  return t;
+  t->frame = TASK_FRAME_FULL;
+  t->priority = TASK_PRIORITY_DEFAULT;
+  t->base_priority = TASK_PRIORITY_DEFAULT;
+  t->mutexes = 0;
+  t->flags = 0;
+  t->quantum = TASK_QUANTUM;
+  t->slice = 0;
+  t->stack = stack;
+  t->stack_size = stack_size;
+  t->joiner = 0;
+  t->notify = 0;
+  t->notify_mask = 0;
+#if TASK_HANDOFF
+  t->handoff = 0;
+#endif
+#if TASK_LOCK
+  t->lock = 0;
+  t->lock_next = 0;
+#endif
+#if TASK_TRACE
+  t->id = ++_task__trace_id;
+#endif
+#if TASK_PERIODIC
+  t->period = 0;
+  t->overruns = 0;
+#endif
+#if TASK_EDF
+  t->deadline = 0;
+  t->misses = 0;
+#endif
+#if TASK_STATS
+  t->runtime = 0;
+  t->switches = 0;
+#endif
+  QUEUE_INIT(&t->member);
+  QUEUE_INIT(&t->timer.link);
+  t->timer.delay = 0;
+#if TASK_TIMERS
+  t->timer.type = TASK_TNODE_TASK;
+#endif
 }
 
-// Creates a task for the specified function.
-// Adds it to the list of user tasks.
-task_t *task_create(task_fn fn, void *data) {
-  task_t *t = task__internal_create(fn, data);
+// Allocate and initialize block with a task struct and a stack of the
+// specified size. The block is taken from a terminated task, or allocated
+// from the top of the stack region.
+// Returns NULL if there is not enough space left in the stack region.
+static task_t *task__alloc(uint16_t stack_size) {
+  uint8_t sreg = SREG;
+  uint8_t *stack;
+  task_t *t;
 
-  QUEUE_INSERT_TAIL(&_tasks__runnable, &t->member);
+  cli();
 
-  return t;
-}
+  t = task__free_get(stack_size);
+  if (t != 0) {
+    // Reuse whole block of terminated task.
+    stack = t->stack;
+    stack_size = t->stack_size;
+  } else {
+#if TASK_STACK_REGION_SIZE > 0
+    if (stack_size + sizeof(task_t) > TASK_STACK_REGION_SIZE - _task__stacks_used) {
+      SREG = sreg;
+      return 0;
+    }
 
-static void task__tick() {
-  QUEUE *q, *r;
-  task_t *t;
+    _task__stacks_used += stack_size + sizeof(task_t);
+    stack = &_task__stacks[TASK_STACK_REGION_SIZE - _task__stacks_used];
+    t = (task_t *)(stack + stack_size);
 
-#if TASK_COUNT_SEC
-  if (--_task_sec_countdown == 0) {
-    _task_sec++;
-    _task_sec_countdown = 1000 / MS_PER_TICK;
-  }
+#if TASK_STATS
+    t->next = _tasks__all;
+    _tasks__all = t;
 #endif
-
-#if TASK_COUNT_MSEC
-  _task_msec += MS_PER_TICK;
+#else
+    // Without stack region, only blocks of terminated tasks are reused.
+    SREG = sreg;
+    return 0;
 #endif
+  }
 
-#if TASK_COUNT_USEC
-  _task_usec += US_PER_TICK;
-#endif
+  SREG = sreg;
 
-  q = QUEUE_NEXT(&_tasks__sleeping);
-  r = 0;
-  for (; q != &_tasks__sleeping; q = r) {
-    // Save pointer to next element so q can be
-    // removed without breaking iteration.
-    r = QUEUE_NEXT(q);
-    t = QUEUE_DATA(q, task_t, member);
+  task__init(t, stack, stack_size);
 
-    if (t->delay) {
-      t->delay--;
-    }
+  return t;
+}
 
-    if (t->delay == 0) {
-      task_wakeup(t);
-    }
+// Creates a task for the specified function.
+// Returns NULL if the stack is too small or the stack region is exhausted.
+task_t *task__internal_create(task_fn fn, void *data, uint16_t stack_size) {
+  task_t *t;
+
+  if (stack_size < TASK_STACK_SIZE_MIN) {
+    return 0;
   }
-}
 
-static void task__scheduler(void) {
-  // Overwrite stack pointer to RAMEND.
-  // The task scheduler runs in its own piece of stack to prevent polluting (or
-  // even overflowing) task stacks when interrupt handlers are executed.
-  asm volatile(
-    "out 0x3d, %A0\n"
-    "out 0x3e, %B0\n"
-    :: "x" (RAMEND)
-  );
+  t = task__alloc(stack_size);
+  if (t == 0) {
+    return 0;
+  }
 
-  for (;;) {
-    QUEUE *q;
+  // Stack grows down, don't overwrite first byte of task struct.
+  t->sp = task__internal_initialize((void *)t - 1, fn, data);
 
-    // No task is currently running.
-    _task__current = 0;
+  return t;
+}
 
-    // Find task to schedule, if any.
-    QUEUE_FOREACH(q, &_tasks__runnable) {
-      // The first runnable task can be scheduled.
-      _task__current = QUEUE_DATA(q, task_t, member);
+#if TASK_COROUTINES
+static void task__exit(task_t *t);
 
-      // Make [head..q] the new tail, so that q->next can be scheduled next.
-      QUEUE_ROTATE(&_tasks__runnable, q);
+// Entry point of a coroutine, kept in place of its stack.
+typedef struct task__co_entry_s task__co_entry_t;
 
-      // This function doesn't continue execution beyond this point.
-      // The task__pop function RETs back into the task.
-      task__pop();
-    }
+struct task__co_entry_s {
+  task_co_fn fn;
+  void *data;
+};
 
-    // The processor wakes up from sleep to handle interrupts.
-    //
-    // 1. It is woken up by the task timer interrupt and the interrupt handler
-    // jumps to this function (i.e. this function doesn't continue execution
-    // beyond the sleep instruction).
-    //
-    // 2. It is woken up by another interrupt, the sleep instruction returns
-    // after the handler has executed, and this function continues execution.
-    //
+task_t *task_create_coroutine(task_co_fn fn, void *data) {
+  task_t *t = task__alloc(sizeof(task__co_entry_t));
+  task__co_entry_t *e;
+  uint8_t sreg = SREG;
 
-    sei();
-    asm volatile ("sleep");
-    cli();
+  if (t == 0) {
+    return 0;
   }
-}
 
-static void task__jmp_scheduler(void) {
-  asm volatile ("ijmp" :: "z" (task__scheduler));
+  e = (task__co_entry_t *)t->stack;
+  e->fn = fn;
+  e->data = data;
+  t->flags = TASK_FLAG_COROUTINE;
+
+  cli();
+  task__runnable_insert(t);
+  SREG = sreg;
+
+  return t;
 }
 
-// Must be naked to avoid mangling the stack.
-static void task__yield_from_timer(void) __attribute__((naked));
-static void task__yield_from_timer(void) {
-  task__push();
+// Run coroutine until it returns, on the scheduler stack with interrupts
+// enabled. It is not preempted by the tick (see task__preempt).
+static void task__co_run(task_t *t) {
+  task__co_entry_t *e = (task__co_entry_t *)t->stack;
+  uint8_t rv;
 
-  task__tick();
+  sei();
+  rv = e->fn(e->data);
+  cli();
 
-  task__jmp_scheduler();
+  if (rv == TASK_CO_EXITED) {
+    task__exit(t);
+  }
 }
+#endif
 
-// ISR can be naked because the first thing it does is push the current task.
-ISR(TIMER0_COMPA_vect, ISR_NAKED) {
-  task__yield_from_timer();
+// Creates a task and adds it to the list of user tasks.
+static task_t *task__create(task_fn fn, void *data, uint16_t stack_size, uint8_t priority) {
+  task_t *t = task__internal_create(fn, data, stack_size);
+  uint8_t sreg = SREG;
 
-  // This interrupt handler was saved as part of the task's state.
-  // We know the task was interrupted, or this handler wouldn't have triggered.
-  // Because SREG was stored from within the ISR, we know the Global Interrupt
-  // Enable bit is not set and we have to re-enable it upon returning from the
-  // interrupt handler. Hence, the RETI.
-  asm volatile ("reti");
+  if (t == 0) {
+    return 0;
+  }
+
+  if (priority > TASK_PRIORITY_MAX) {
+    priority = TASK_PRIORITY_MAX;
+  }
+
+  t->priority = priority;
+  t->base_priority = priority;
+
+  cli();
+  task__runnable_insert(t);
+  SREG = sreg;
+
+  return t;
 }
 
-// Use TIMER0 for OS ticks.
-// Configure it to trigger a Output Compare Register interrupt every 2ms.
-static void task__setup_timer() {
-  // Waveform generation mode: CTC
-  // WGM02: 0
-  // WGM01: 1
-  // WGM00: 0
-  TCCR0A = _BV(WGM01);
+// Creates a task for the specified function with the specified priority.
+task_t *task_create_priority(task_fn fn, void *data, uint8_t priority) {
+  return task__create(fn, data, TASK_STACK_SIZE, priority);
+}
 
-  // Clock select (see task.h)
-  TCCR0B = _TCCR0B;
+// Creates a task for the specified function with the specified stack size.
+task_t *task_create_ex(task_fn fn, void *data, uint16_t stack_size) {
+  return task__create(fn, data, stack_size, TASK_PRIORITY_DEFAULT);
+}
 
-  // Output compare register
-  OCR0A = COUNTS_PER_TICK - 1;
+// Creates a task for the specified function.
+task_t *task_create(task_fn fn, void *data) {
+  return task__create(fn, data, TASK_STACK_SIZE, TASK_PRIORITY_DEFAULT);
 }
 
-void task_init(void) {
-  QUEUE_INIT(&_tasks__runnable);
-  QUEUE_INIT(&_tasks__suspended);
-  QUEUE_INIT(&_tasks__sleeping);
+#if TASK_STATIC_TASKS
+// Start the tasks in the static task table.
+static void task__static_start(void) {
+  const task_static_t *d;
+  task_static_t e;
+  uint8_t sreg = SREG;
+  task_t *t;
 
-  task__setup_timer();
+  for (d = task_static_table; ; d++) {
+    memcpy_P(&e, d, sizeof(e));
+    if (e.task == 0) {
+      break;
+    }
+
+    t = e.task;
+    task__init(t, e.stack, e.stack_size);
+
+    // Stack grows down from its last byte.
+    t->sp = task__internal_initialize(e.stack + e.stack_size - 1, e.fn, e.data);
+
+    if (e.priority > TASK_PRIORITY_MAX) {
+      e.priority = TASK_PRIORITY_MAX;
+    }
+
+    t->priority = e.priority;
+    t->base_priority = e.priority;
+
+    cli();
+#if TASK_STATS
+    t->next = _tasks__all;
+    _tasks__all = t;
+#endif
+    task__runnable_insert(t);
+    SREG = sreg;
+  }
+}
+#endif
+
+static void task__expire(uint16_t ticks);
+
+// Advance time by the specified number of ticks.
+static void task__advance(uint8_t ticks) {
+  _task__ticks += ticks;
 
 #if TASK_COUNT_SEC
-  task_set_sec(0);
+  if (_task_sec_countdown <= ticks) {
+    _task_sec++;
+    _task_sec_countdown += 1000 / MS_PER_TICK;
+  }
+  _task_sec_countdown -= ticks;
 #endif
 
 #if TASK_COUNT_MSEC
-  task_set_msec(0);
+  _task_msec += ticks * MS_PER_TICK;
 #endif
 
 #if TASK_COUNT_USEC
-  task_set_usec(0);
+  _task_usec += ticks * US_PER_TICK;
+#endif
+
+#if TASK_LOCK
+  // The timeline belongs to the task holding the scheduler lock. It catches
+  // up when the lock is released.
+  if (_task__lock) {
+    _task__lock_ticks += ticks;
+    return;
+  }
 #endif
+
+  task__expire(ticks);
 }
 
-// Call this function to start task execution.
-// Never returns.
-void task_start(void) {
-  // Global interrupt bit will be enabled when task is popped.
-  cli();
+// Expire entries in the timeline that are due after the specified number of
+// ticks, waking up their tasks.
+static void task__expire(uint16_t ticks) {
+  QUEUE *q;
+  task_tnode_t *n;
+  task_t *t;
 
-  // Enable interrupt on OCR0A match
-  TIMSK0 |= _BV(OCIE0A);
+  // Only the first entry in the delta queue needs to be decremented.
+  // Wake up tasks from the head of the queue while they are due.
+  for (;;) {
+    q = QUEUE_HEAD(&_tasks__sleeping);
+    if (q == &_tasks__sleeping) {
+      break;
+    }
 
-  // Schedule next task to run.
-  task__jmp_scheduler();
+    n = QUEUE_DATA(q, task_tnode_t, link);
+    if (n->delay > ticks) {
+      n->delay -= ticks;
+      break;
+    }
+
+    ticks -= n->delay;
+    n->delay = 0;
+
+#if TASK_TIMERS
+    if (n->type == TASK_TNODE_TIMER) {
+      // Its function is called by the scheduler. Remember when it expired.
+      QUEUE_REMOVE(q);
+      QUEUE_INSERT_TAIL(&_task__timers_due, q);
+      n->type = TASK_TNODE_TIMER_DUE;
+      n->delay = (uint16_t)_task__ticks - ticks;
+      continue;
+    }
+#endif
+
+    t = QUEUE_DATA(n, task_t, timer);
+
+    // A suspended task on the sleep queue is waiting with a timeout.
+    if (t->state == TASK_STATE_SUSPENDED) {
+      t->flags |= TASK_FLAG_TIMEOUT;
+    }
+
+    task_wakeup(t);
+  }
 }
 
-// Yield execution to any other schedulable task.
-void task_yield(void) __attribute__((naked));
-void task_yield(void) {
-  task__push();
+#if TASK_LOCK
+// Apply the ticks and wakeups that were deferred while the scheduler was
+// locked. Must be called with interrupts disabled and the scheduler unlocked.
+static void task__lock_apply(void) {
+  task_t *t;
 
-  task__jmp_scheduler();
+  // Wakeups first: a task that already left its wait queue doesn't time out.
+  while (_task__lock_wakeups) {
+    t = _task__lock_wakeups;
+    _task__lock_wakeups = t->lock_next;
+    t->flags &= ~TASK_FLAG_WAKEUP;
+    task_wakeup(t);
+  }
+
+  if (_task__lock_ticks) {
+    task__expire(_task__lock_ticks);
+    _task__lock_ticks = 0;
+  }
 }
+#endif
 
-// Return pointer to current task.
-task_t *task_current(void) {
-  return _task__current;
+#if TASK_TICKLESS
+// Start idle period if no task is due within the next IDLE_TICKS_STEP ticks.
+// The timer is switched to the idle prescaler and set to fire when the first
+// sleeping task is due. Must be called with interrupts disabled.
+static void task__idle_enter(void) {
+  QUEUE *q = QUEUE_HEAD(&_tasks__sleeping);
+  uint16_t ticks = IDLE_TICKS_MAX;
+  uint8_t count;
+
+  if (q != &_tasks__sleeping) {
+    if (QUEUE_DATA(q, task_tnode_t, link)->delay < ticks) {
+      ticks = QUEUE_DATA(q, task_tnode_t, link)->delay;
+    }
+  }
+
+  // The idle period must be a whole number of counts at the idle prescaler.
+  ticks -= ticks % IDLE_TICKS_STEP;
+  if (ticks == 0) {
+    return;
+  }
+
+  // Let a pending tick be handled first.
+  if (TIFR0 & _BV(OCF0A)) {
+    return;
+  }
+
+  count = TCNT0;
+  _task__idle_ticks = ticks;
+  _task__idle_residue = count % IDLE_COUNT_SCALE;
+
+  TCCR0B = _TCCR0B_IDLE;
+  OCR0A = (ticks * COUNTS_PER_TICK) / IDLE_COUNT_SCALE - 1;
+  TCNT0 = count / IDLE_COUNT_SCALE;
+}
+
+// End idle period and restore the regular tick.
+// The argument specifies whether the idle period ran to completion.
+// Returns the number of ticks that passed since the idle period started.
+// Must be called with interrupts disabled.
+static uint8_t task__idle_exit(uint8_t done) {
+  uint8_t count = TCNT0;
+  uint8_t ticks = 0;
+  uint16_t counts;
+
+  // The idle period may have completed since the processor woke up.
+  if (!done && (TIFR0 & _BV(OCF0A))) {
+    TIFR0 = _BV(OCF0A);
+    count = TCNT0;
+    done = 1;
+  }
+
+  if (done) {
+    ticks = _task__idle_ticks;
+  }
+
+  // Convert counts into ticks at the regular prescaler.
+  counts = count * IDLE_COUNT_SCALE + _task__idle_residue;
+  ticks += counts / COUNTS_PER_TICK;
+  counts %= COUNTS_PER_TICK;
+
+  _task__idle_ticks = 0;
+
+  TCCR0B = _TCCR0B;
+  OCR0A = COUNTS_PER_TICK - 1;
+  TCNT0 = counts;
+
+  return ticks;
+}
+#endif // TASK_TICKLESS
+
+static void task__tick() {
+  uint8_t ticks = 1;
+
+#if TASK_TICKLESS
+  if (_task__idle_ticks) {
+    ticks = task__idle_exit(1);
+  }
+#endif
+
+#if TASK_TRACE_TICKS
+  TRACE(TRACE_TICK, ticks);
+#endif
+
+  task__advance(ticks);
+}
+
+// Return whether the current task must be switched out on this tick, which
+// is the case when its quantum has expired or a task of equal or higher
+// priority was woken up. Called from the tick interrupt, after task__tick.
+static uint8_t task__preempt(void) {
+  task_t *t = _task__current;
+  uint8_t expired = 0;
+
+  if (t == 0) {
+    return 1;
+  }
+
+#if TASK_COROUTINES
+  // A coroutine runs on the scheduler stack until it returns.
+  if (t->flags & TASK_FLAG_COROUTINE) {
+    return 0;
+  }
+#endif
+
+  if (t->slice > 1) {
+    t->slice--;
+  } else if (QUEUE_NEXT(&t->member) == QUEUE_PREV(&t->member)) {
+    // Alone in its run queue (both neighbours are the head), so the scheduler
+    // would pick it again. Start a new quantum instead.
+    t->slice = t->quantum;
+  } else {
+    expired = 1;
+  }
+
+#if TASK_LOCK
+  // Switch when the scheduler is unlocked instead.
+  if (_task__lock) {
+    if (_task__resched || expired) {
+      _task__lock_preempt = 1;
+    }
+    return 0;
+  }
+#endif
+
+  if (!_task__resched && !expired) {
+#if TASK_TIMERS
+    // Switch to the scheduler to call timer functions, and resume this task
+    // afterwards.
+    if (!QUEUE_EMPTY(&_task__timers_due)) {
+      _task__timers_resume = 1;
+      return 1;
+    }
+#endif
+
+    return 0;
+  }
+
+#if TASK_STATS
+  _task__stats.preemptions++;
+#endif
+
+  return 1;
+}
+
+void task_yield_from_isr(void) {
+  task_t *t = _task__current;
+
+  // The scheduler (or a coroutine on its stack) was interrupted, and picks
+  // the woken task when it gets to it.
+  if (t == 0 || (t->flags & TASK_FLAG_COROUTINE)) {
+    return;
+  }
+
+  // Only switch if a task of higher priority is runnable, or if the handler
+  // yielded to a task (see task_yield_to).
+  if ((_tasks__runnable_bitmap >> t->priority) <= 1 && !_task__yield_to) {
+    return;
+  }
+
+#if TASK_LOCK
+  // The interrupted task holds the scheduler lock, and switches when it is
+  // released.
+  if (_task__lock) {
+    return;
+  }
+#endif
+
+#if TASK_ISR_STACK && !TASK_HOST
+  // Switch when back on the stack of the interrupted task (see TASK_ISR).
+  if (_task__isr_sp != 0) {
+    _task__isr_yield = 1;
+    return;
+  }
+#endif
+
+#if TASK_STATS
+  _task__stats.preemptions++;
+#endif
+
+  // The interrupted task resumes here, and then returns from the interrupt.
+  task_yield();
+}
+
+#if TASK_ISR_STACK && !TASK_HOST
+void task__isr_exit(void) {
+  if (_task__isr_yield) {
+    _task__isr_yield = 0;
+    task_yield_from_isr();
+  }
+}
+#endif
+
+#if TASK_STACK_CHECK
+uint16_t task_stack_free(task_t *t) {
+  uint16_t n = 0;
+
+  while (n < t->stack_size && t->stack[n] == TASK_STACK_PAINT) {
+    n++;
+  }
+
+  return n;
+}
+
+// Default overflow handler: halt.
+void task_stack_overflow(task_t *t) __attribute__((weak));
+void task_stack_overflow(task_t *t) {
+  cli();
+  for (;;) {
+    continue;
+  }
 }
 
-void task__suspend(QUEUE *h) {
+// Check stack of task that was just switched out.
+static void task__stack_check(task_t *t) {
+#if TASK_HOST
+  // Tasks run on host stacks (see host/port.h), only the paint is checked.
+  if (t->stack[0] == TASK_STACK_PAINT) {
+#else
+  // The saved stack pointer points at the first free byte.
+  if ((uint8_t *)t->sp >= t->stack && t->stack[0] == TASK_STACK_PAINT) {
+#endif
+    return;
+  }
+
+  task_stack_overflow(t);
+
+  // Never resume this task.
+  if (t->state == TASK_STATE_RUNNABLE) {
+    task__runnable_remove(t);
+    QUEUE_INSERT_TAIL(&_tasks__suspended, &t->member);
+    t->state = TASK_STATE_SUSPENDED;
+  }
+}
+#endif // TASK_STACK_CHECK
+
+#if TASK_STATS
+// Add time since the last switch to the run time of the specified task, or
+// to the idle time if it is NULL. Must be called with interrupts disabled.
+static void task__stats_account(task_t *t) {
+  uint16_t now = task__clock();
+  uint16_t elapsed = now - _task__stats_clock;
+
+  // The scheduler runs well within the 16 bit range of the clock.
+  _task__stats_clock = now;
+
+  if (t) {
+    t->runtime += elapsed;
+  } else {
+    _task__stats.idle += elapsed;
+  }
+}
+
+// Copy statistics.
+uint8_t task_stats(task_stats_t *sys, task_stat_t *stats, uint8_t len) {
   uint8_t sreg = SREG;
+  uint8_t n = 0;
+  task_t *t;
 
   cli();
 
-  QUEUE *q = &_task__current->member;
-  QUEUE_REMOVE(q);
-  QUEUE_INSERT_TAIL(h, q);
+  // Include run time of the current task up to now.
+  task__stats_account(_task__current);
 
-  task_yield();
+  if (sys) {
+    *sys = _task__stats;
+  }
+
+  for (t = _tasks__all; t != 0; t = t->next) {
+    if (t->state == TASK_STATE_EXITED) {
+      continue;
+    }
+
+    if (n < len) {
+      stats[n].task = t;
+      stats[n].state = task_state(t);
+      stats[n].priority = t->priority;
+      stats[n].switches = t->switches;
+      stats[n].runtime = t->runtime;
+    }
+
+    n++;
+  }
 
   SREG = sreg;
+
+  return n;
 }
+#endif // TASK_STATS
+
+#if TASK_EDF
+// Return the runnable task of the specified priority with the earliest
+// absolute deadline. Tasks without a deadline come last. Ties go to the task
+// closest to the head of the run queue, which keeps them in round-robin order.
+static task_t *task__edf_select(uint8_t priority) {
+  task_t *t, *u = task__runnable_head(priority);
+
+  for (t = u; t != 0; t = task__runnable_next(t)) {
+    if (t->deadline == 0) {
+      continue;
+    }
 
-// Suspend task until it is woken up explicitly.
-void task_suspend(QUEUE *h) {
-  if (h == 0) {
-    h = &_tasks__suspended;
+    if (u->deadline == 0 ||
+        (int16_t)((t->release + t->deadline) - (u->release + u->deadline)) < 0) {
+      u = t;
+    }
   }
 
-  task__suspend(h);
+  return u;
 }
+#endif
 
-// Wake up task.
-void task_wakeup(task_t *t) {
+#if TASK_TIMERS
+// Call functions of due timers, in the order they expired.
+// Periodic timers are put back in the timeline first, in phase with the tick
+// they expired at. Must be called with interrupts disabled.
+static void task__timers_run(void) {
+  QUEUE *q;
+  task_timer_t *t;
+  uint16_t late;
+
+  _task__timers_running = 1;
+
+  while (!QUEUE_EMPTY(&_task__timers_due)) {
+    q = QUEUE_HEAD(&_task__timers_due);
+    t = QUEUE_DATA(q, task_timer_t, node.link);
+
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    t->node.type = TASK_TNODE_TIMER;
+
+    if (t->period) {
+      late = (uint16_t)_task__ticks - t->node.delay;
+      task__sleep_insert(&t->node, t->period - late % t->period);
+    }
+
+    t->fn(t->data);
+  }
+
+  _task__timers_running = 0;
+}
+
+void task_timer_init(task_timer_t *t, task_timer_fn fn, void *data) {
+  QUEUE_INIT(&t->node.link);
+  t->node.delay = 0;
+  t->node.type = TASK_TNODE_TIMER;
+  t->period = 0;
+  t->fn = fn;
+  t->data = data;
+}
+
+void task_timer_start(task_timer_t *t, uint16_t ms, uint16_t period) {
   uint8_t sreg = SREG;
 
   cli();
 
-  QUEUE *q = &t->member;
-  QUEUE_REMOVE(q);
-  QUEUE_INSERT_TAIL(&_tasks__runnable, q);
+  task_timer_stop(t);
+  t->period = period ? TASK_TIMEOUT_TICKS(period) : 0;
+  task__sleep_insert(&t->node, MS_TO_TICKS(ms));
 
   SREG = sreg;
 }
 
-// Make current task sleep for specified number of ticks.
-void task_sleep(uint16_t ms) {
-  _task__current->delay = ms / MS_PER_TICK;
-  task__suspend(&_tasks__sleeping);
+void task_timer_stop(task_timer_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (!QUEUE_EMPTY(&t->node.link)) {
+    if (t->node.type == TASK_TNODE_TIMER) {
+      task__sleep_remove(&t->node);
+    } else {
+      QUEUE_REMOVE(&t->node.link);
+      QUEUE_INIT(&t->node.link);
+      t->node.type = TASK_TNODE_TIMER;
+    }
+  }
+
+  SREG = sreg;
+}
+
+uint8_t task_timer_active(task_timer_t *t) {
+  uint8_t sreg = SREG;
+  uint8_t active;
+
+  cli();
+  active = !QUEUE_EMPTY(&t->node.link);
+  SREG = sreg;
+
+  return active;
+}
+#endif // TASK_TIMERS
+
+static void task__scheduler(void) {
+#if !TASK_HOST
+  // Overwrite stack pointer to RAMEND.
+  // The task scheduler runs in its own piece of stack to prevent polluting (or
+  // even overflowing) task stacks when interrupt handlers are executed.
+  asm volatile(
+    "out 0x3d, %A0\n"
+    "out 0x3e, %B0\n"
+    :: "x" (RAMEND)
+  );
+#endif
+
+  for (;;) {
+    task_t *t;
+    uint8_t p;
+
+#if TASK_STATS
+    // Account time to task that was switched out, or to idle time.
+    task__stats_account(_task__current);
+#endif
+
+    if (_task__current) {
+      TRACE(TRACE_SWITCH_OUT, _task__current->id);
+    }
+
+#if TASK_STACK_CHECK
+    if (_task__current && !(_task__current->flags & TASK_FLAG_COROUTINE)) {
+      task__stack_check(_task__current);
+    }
+#endif
+
+#if TASK_LOCK
+    // A task that blocks while holding the scheduler lock gets it back when
+    // it is resumed. Other tasks run with the scheduler unlocked.
+    if (_task__current) {
+      _task__current->lock = _task__lock;
+    }
+    _task__lock = 0;
+    task__lock_apply();
+#endif
+
+#if TASK_TIMERS
+    // Like interrupt handlers, timer functions run in the context of the task
+    // that was switched out. They may wake up tasks, so run them first.
+    task__timers_run();
+
+    // Resume the task if it was only switched out to run timer functions,
+    // unless they woke up a task it would have been preempted by.
+    if (_task__timers_resume) {
+      _task__timers_resume = 0;
+      if (!_task__resched && _task__current->state == TASK_STATE_RUNNABLE) {
+        TRACE(TRACE_SWITCH_IN, _task__current->id);
+#if TASK_LOCK
+        _task__lock = _task__current->lock;
+#endif
+        task__pop();
+      }
+    }
+#endif
+
+    // No task is currently running.
+    _task__current = 0;
+    _task__resched = 0;
+#if TASK_LOCK
+    _task__lock_preempt = 0;
+#endif
+
+    // Find task to schedule, if any.
+    if (_tasks__runnable_bitmap) {
+      // The first runnable task with the highest priority can be scheduled.
+      p = task__highest_priority();
+#if TASK_EDF
+      t = task__edf_select(p);
+#else
+      t = task__runnable_head(p);
+#endif
+
+      // Unless a task yielded to a task of this priority.
+      if (_task__yield_to) {
+        if (_task__yield_to->state == TASK_STATE_RUNNABLE &&
+            _task__yield_to->priority == p) {
+          t = _task__yield_to;
+        }
+        _task__yield_to = 0;
+      }
+      _task__current = t;
+      _task__current->slice = _task__current->quantum;
+#if TASK_LOCK
+      _task__lock = t->lock;
+#endif
+
+      // Make [head..t] the new tail, so that the task after t can be
+      // scheduled next.
+      task__runnable_rotate(t);
+
+#if TASK_STATS
+      _task__current->switches++;
+      _task__stats.switches++;
+#endif
+
+      TRACE(TRACE_SWITCH_IN, _task__current->id);
+
+#if TASK_COROUTINES
+      if (_task__current->flags & TASK_FLAG_COROUTINE) {
+        task__co_run(_task__current);
+        continue;
+      }
+#endif
+
+      // This function doesn't continue execution beyond this point.
+      // The task__pop function RETs back into the task.
+      task__pop();
+    }
+
+    // The processor wakes up from sleep to handle interrupts.
+    //
+    // 1. It is woken up by the task timer interrupt and the interrupt handler
+    // jumps to this function (i.e. this function doesn't continue execution
+    // beyond the sleep instruction).
+    //
+    // 2. It is woken up by another interrupt, the sleep instruction returns
+    // after the handler has executed, and this function continues execution.
+    //
+    // In tickless mode the tick timer is slowed down for the duration of the
+    // sleep. If the processor is woken up by another interrupt, the time that
+    // passed is accounted for before looking for a task to schedule.
+    //
+
+#if TASK_TRACE_TICKS
+    TRACE(TRACE_IDLE, 0);
+#endif
+
+#if TASK_TICKLESS
+    task__idle_enter();
+#endif
+
+#if TASK_HOST
+    task__host_idle();
+#else
+    sei();
+    asm volatile ("sleep");
+    cli();
+#endif
+
+#if TASK_TICKLESS
+    if (_task__idle_ticks) {
+      task__advance(task__idle_exit(0));
+    }
+#endif
+  }
+}
+
+#if !TASK_HOST
+static void task__jmp_scheduler(void) {
+  asm volatile ("ijmp" :: "z" (task__scheduler));
+}
+
+// Called from the tick interrupt with only the call-clobbered registers
+// saved. Returns whether the current task must be switched out.
+static uint8_t task__timer_tick(void) __attribute__((used));
+static uint8_t task__timer_tick(void) {
+  task__tick();
+
+  return task__preempt();
+}
+
+// Must be naked to avoid mangling the stack.
+//
+// Most ticks neither wake up a task nor expire the slice of the current task.
+// The fast path therefore only saves the registers that task__timer_tick may
+// clobber, and returns to the interrupted task right away. The call-saved
+// registers are preserved by task__timer_tick itself. Only if the task must
+// be switched out, the partial frame is dropped and the full context is
+// pushed, with all registers holding the values of the interrupted task.
+static void task__yield_from_timer(void) __attribute__((naked));
+static void task__yield_from_timer(void) {
+  asm volatile(
+    "push r0\n"
+    "in r0, 0x3f\n"
+    "push r0\n"
+    "push r1\n"
+    "push r18\n"
+    "push r19\n"
+    "push r20\n"
+    "push r21\n"
+    "push r22\n"
+    "push r23\n"
+    "push r24\n"
+    "push r25\n"
+    "push r26\n"
+    "push r27\n"
+    "push r30\n"
+    "push r31\n"
+
+    // Compiler expects r1 to be zero.
+    "clr r1\n"
+
+#if TASK_ISR_STACK
+    // Run the tick on the interrupt stack.
+    "in r24, 0x3d\n"
+    "in r25, 0x3e\n"
+    "sts _task__isr_sp, r24\n"
+    "sts _task__isr_sp+1, r25\n"
+    "ldi r24, lo8(_task__isr_stack+%0)\n"
+    "ldi r25, hi8(_task__isr_stack+%0)\n"
+    "out 0x3d, r24\n"
+    "out 0x3e, r25\n"
+
+    "call task__timer_tick\n"
+
+    "lds r26, _task__isr_sp\n"
+    "lds r27, _task__isr_sp+1\n"
+    "out 0x3d, r26\n"
+    "out 0x3e, r27\n"
+    "sts _task__isr_sp, r1\n"
+    "sts _task__isr_sp+1, r1\n"
+#else
+    "call task__timer_tick\n"
+#endif
+
+    // Keep result (0 or 1) in the T flag, restoring the registers clobbers r24.
+    "bst r24, 0\n"
+
+    "pop r31\n"
+    "pop r30\n"
+    "pop r27\n"
+    "pop r26\n"
+    "pop r25\n"
+    "pop r24\n"
+    "pop r23\n"
+    "pop r22\n"
+    "pop r21\n"
+    "pop r20\n"
+    "pop r19\n"
+    "pop r18\n"
+    "pop r1\n"
+
+    // Switch out the task if T is set. The status register is restored
+    // below, so T holds its original value again in either case.
+    "brts 2f\n"
+    "pop r0\n"
+    "out 0x3f, r0\n"
+    "pop r0\n"
+    "ret\n"
+
+  "2:\n"
+    "pop r0\n"
+    "out 0x3f, r0\n"
+    "pop r0\n"
+#if TASK_ISR_STACK
+    :: "i" (TASK_ISR_STACK_SIZE - 1)
+#endif
+  );
+
+  task__push();
+
+  task__jmp_scheduler();
+}
+
+// ISR can be naked because the first thing it does is push the current task.
+ISR(TIMER0_COMPA_vect, ISR_NAKED) {
+  task__yield_from_timer();
+
+  // This interrupt handler was saved as part of the task's state.
+  // We know the task was interrupted, or this handler wouldn't have triggered.
+  // Because SREG was stored from within the ISR, we know the Global Interrupt
+  // Enable bit is not set and we have to re-enable it upon returning from the
+  // interrupt handler. Hence, the RETI.
+  asm volatile ("reti");
+}
+
+// Use TIMER0 for OS ticks.
+// Configure it to trigger a Output Compare Register interrupt every 2ms.
+static void task__setup_timer() {
+  // Waveform generation mode: CTC
+  // WGM02: 0
+  // WGM01: 1
+  // WGM00: 0
+  TCCR0A = _BV(WGM01);
+
+  // Clock select (see task.h)
+  TCCR0B = _TCCR0B;
+
+  // Output compare register
+  OCR0A = COUNTS_PER_TICK - 1;
+}
+#endif // !TASK_HOST
+
+void task_init(void) {
+  uint8_t i;
+
+  for (i = 0; i < TASK_PRIORITIES; i++) {
+    QUEUE_INIT(&_tasks__runnable[i]);
+  }
+
+  _tasks__runnable_bitmap = 0;
+  QUEUE_INIT(&_tasks__suspended);
+  QUEUE_INIT(&_tasks__sleeping);
+  QUEUE_INIT(&_tasks__free);
+#if TASK_TIMERS
+  QUEUE_INIT(&_task__timers_due);
+#endif
+
+  task__setup_timer();
+
+#if TASK_TICKLESS
+  // Enable sleep (idle mode) so the processor halts until the next interrupt.
+  SMCR = _BV(SE);
+#endif
+
+#if TASK_COUNT_SEC
+  task_set_sec(0);
+#endif
+
+#if TASK_COUNT_MSEC
+  task_set_msec(0);
+#endif
+
+#if TASK_COUNT_USEC
+  task_set_usec(0);
+#endif
+
+#if TASK_STATIC_TASKS
+  task__static_start();
+#endif
+}
+
+// Call this function to start task execution.
+// Never returns.
+void task_start(void) {
+  // Global interrupt bit will be enabled when task is popped.
+  cli();
+
+#if TASK_STATS
+  // Start accounting from here.
+  _task__stats_clock = task__clock();
+#endif
+
+  // Enable interrupt on OCR0A match
+  TIMSK0 |= _BV(OCIE0A);
+
+  // Schedule next task to run.
+  task__jmp_scheduler();
+}
+
+#if !TASK_HOST
+// Yield execution to any other schedulable task.
+//
+// As this is a regular function call, the compiler already saved any
+// call-clobbered registers it cares about. Only the call-saved registers
+// (r2-r17, r28-r29) and the status register need to be pushed, which makes
+// for a much smaller frame than the one pushed when a task is preempted.
+// The frame type is recorded in the task struct for task__pop.
+void task_yield(void) __attribute__((naked));
+void task_yield(void) {
+  asm volatile(
+    // Save status register
+    "in r0, 0x3f\n"
+    "cli\n"
+    "push r0\n"
+
+    // Save call-saved registers
+    "push r2\n"
+    "push r3\n"
+    "push r4\n"
+    "push r5\n"
+    "push r6\n"
+    "push r7\n"
+    "push r8\n"
+    "push r9\n"
+    "push r10\n"
+    "push r11\n"
+    "push r12\n"
+    "push r13\n"
+    "push r14\n"
+    "push r15\n"
+    "push r16\n"
+    "push r17\n"
+    "push r28\n"
+    "push r29\n"
+
+    // Load _task__current into Z register pair
+    "lds r30, _task__current\n" // Low
+    "lds r31, _task__current+1\n" // High
+
+    // Save stack pointer in current task struct
+    "in r0, 0x3d\n" // Low
+    "st z+, r0\n"
+    "in r0, 0x3e\n" // High
+    "st z+, r0\n"
+
+    // Mark frame as cooperative (TASK_FRAME_COOP)
+    "ldi r18, 1\n"
+    "st z, r18\n"
+  );
+
+  task__jmp_scheduler();
+}
+#endif // !TASK_HOST
+
+// Return pointer to current task.
+task_t *task_current(void) {
+  return _task__current;
+}
+
+uint8_t task__in_task(void) {
+  if (_task__current == 0) {
+    return 0;
+  }
+
+#if TASK_TIMERS
+  if (_task__timers_running) {
+    return 0;
+  }
+#endif
+
+#if TASK_ISR_STACK && !TASK_HOST
+  if (_task__isr_sp != 0) {
+    return 0;
+  }
+#endif
+
+  return 1;
+}
+
+// Change effective priority of task.
+// A runnable task is moved to the tail of the run queue for its new priority.
+// A waiting task keeps its position in the queue it is waiting on.
+void task__set_effective_priority(task_t *t, uint8_t priority) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (t->state == TASK_STATE_RUNNABLE) {
+    task__runnable_remove(t);
+    t->priority = priority;
+    task__runnable_insert(t);
+  } else {
+    t->priority = priority;
+  }
+
+  SREG = sreg;
+}
+
+// Change priority of task.
+void task_set_priority(task_t *t, uint8_t priority) {
+  uint8_t sreg = SREG;
+
+  if (priority > TASK_PRIORITY_MAX) {
+    priority = TASK_PRIORITY_MAX;
+  }
+
+  cli();
+
+  t->base_priority = priority;
+
+  // Don't drop below a priority inherited through a mutex.
+  if (t->mutexes == 0 || priority > t->priority) {
+    task__set_effective_priority(t, priority);
+  }
+
+  SREG = sreg;
+}
+
+void task_set_quantum(task_t *t, uint8_t ticks) {
+  // Run for one tick at the very least.
+  if (ticks == 0) {
+    ticks = 1;
+  }
+
+  t->quantum = ticks;
+}
+
+// Switch out current task, unless it is a coroutine.
+void task__yield(void) {
+#if TASK_COROUTINES
+  // A coroutine returns to the scheduler by itself.
+  if (_task__current->flags & TASK_FLAG_COROUTINE) {
+    return;
+  }
+#endif
+
+  task_yield();
+}
+
+// Switch out current task, or have it switched out as soon as possible if not
+// called on its stack: timer functions run on the scheduler stack, and
+// handlers declared with TASK_ISR on the interrupt stack.
+// Must be called with interrupts disabled.
+static void task__reschedule(void) {
+#if TASK_TIMERS
+  // Pick a task instead of resuming the current one after the timers.
+  if (_task__timers_running) {
+    _task__resched = 1;
+    return;
+  }
+#endif
+
+#if TASK_ISR_STACK && !TASK_HOST
+  if (_task__isr_sp != 0) {
+    _task__isr_yield = 1;
+    return;
+  }
+#endif
+
+  task__yield();
+}
+
+void task_yield_to(task_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (_task__current != 0 && t->state == TASK_STATE_RUNNABLE &&
+      t != _task__current && t->priority >= _task__current->priority) {
+    _task__yield_to = t;
+#if TASK_LOCK
+    // Switch when the scheduler is unlocked.
+    if (_task__lock) {
+      SREG = sreg;
+      return;
+    }
+#endif
+    task__reschedule();
+  }
+
+  SREG = sreg;
+}
+
+#if TASK_LOCK
+void task_lock(void) {
+  _task__lock++;
+
+  // Keep accesses to state protected by the lock after this point.
+  asm volatile ("" ::: "memory");
+}
+
+void task_unlock(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (--_task__lock == 0) {
+    task__lock_apply();
+
+    // An idle scheduler picks the tasks that were woken up by itself.
+    if (_task__current == 0) {
+      SREG = sreg;
+      return;
+    }
+
+    // Switch now if the tick would have preempted this task, if it yielded
+    // to another task, or if a task of higher priority was woken up. From a
+    // timer function or a TASK_ISR handler, the scheduler switches when it
+    // returns.
+    if (_task__lock_preempt || _task__yield_to ||
+        (_tasks__runnable_bitmap >> _task__current->priority) > 1) {
+      task__reschedule();
+    }
+#if TASK_TIMERS
+    // Call timer functions that became due while locked. Not from a timer
+    // function or TASK_ISR handler, they are called on the next tick then.
+    else if (!QUEUE_EMPTY(&_task__timers_due) && !_task__timers_running &&
+#if TASK_ISR_STACK && !TASK_HOST
+             _task__isr_sp == 0 &&
+#endif
+             !(_task__current->flags & TASK_FLAG_COROUTINE)) {
+      _task__timers_resume = 1;
+      task__yield();
+    }
+#endif
+  }
+
+  SREG = sreg;
+}
+#endif
+
+// Suspend current task in queue h, and on the sleep queue if ticks is not 0.
+int8_t task__suspend(QUEUE *h, uint16_t ticks) {
+  task_t *t = _task__current;
+  uint8_t sreg = SREG;
+
+  if (h == 0) {
+    h = &_tasks__suspended;
+  }
+
+  cli();
+
+  task__runnable_remove(t);
+  task__wait_insert(h, t);
+  t->state = TASK_STATE_SUSPENDED;
+  t->flags &= ~TASK_FLAG_TIMEOUT;
+
+  if (ticks) {
+    task__sleep_insert(&t->timer, ticks);
+  }
+
+  TRACE(TRACE_SUSPEND, t->id);
+
+  task__yield();
+
+  SREG = sreg;
+
+  return (t->flags & TASK_FLAG_TIMEOUT) ? -1 : 0;
+}
+
+// Suspend task until it is woken up explicitly.
+void task_suspend(QUEUE *h) {
+  task__suspend(h, 0);
+}
+
+// Suspend task until it is woken up explicitly or the timeout expires.
+int8_t task_suspend_timeout(QUEUE *h, uint16_t ms) {
+  return task__suspend(h, TASK_TIMEOUT_TICKS(ms));
+}
+
+// Wake up task.
+void task_wakeup(task_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (t->state != TASK_STATE_SLEEPING && t->state != TASK_STATE_SUSPENDED) {
+    // Already runnable or terminated.
+    SREG = sreg;
+    return;
+  }
+
+#if TASK_LOCK
+  // Interrupt handlers run with interrupts disabled. While the scheduler is
+  // locked, the queues belong to the task holding the lock, and wakeups from
+  // interrupt handlers are applied when it is released.
+  if (_task__lock && !(sreg & _BV(SREG_I))) {
+    // Leave the wait queue now, so that the next waiter is found by whoever
+    // wakes up tasks from it (e.g. cond_broadcast).
+    if (t->state == TASK_STATE_SUSPENDED) {
+      QUEUE_REMOVE(&t->member);
+      QUEUE_INIT(&t->member);
+    }
+    if (!(t->flags & TASK_FLAG_WAKEUP)) {
+      t->flags |= TASK_FLAG_WAKEUP;
+      t->lock_next = _task__lock_wakeups;
+      _task__lock_wakeups = t;
+    }
+    SREG = sreg;
+    return;
+  }
+#endif
+
+  // Sleeping, or suspended with a timeout.
+  if (!QUEUE_EMPTY(&t->timer.link)) {
+    task__sleep_remove(&t->timer);
+  }
+
+  if (t->state == TASK_STATE_SUSPENDED) {
+    QUEUE_REMOVE(&t->member);
+  }
+
+  task__runnable_insert(t);
+
+  TRACE(TRACE_WAKEUP, t->id);
+
+#if TASK_STATS
+  _task__stats.wakeups++;
+#endif
+
+  SREG = sreg;
+}
+
+// Return whether any or all of the bits in mask are pending for task.
+static uint8_t task__notified(task_t *t, uint8_t mask, uint8_t all) {
+  uint8_t bits = t->notify & mask;
+
+  return all ? bits == mask : bits != 0;
+}
+
+void task_notify(task_t *t, uint8_t bits) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  t->notify |= bits;
+
+  if (t->notify_mask &&
+      task__notified(t, t->notify_mask, t->flags & TASK_FLAG_NOTIFY_ALL)) {
+    task_wakeup(t);
+  }
+
+  SREG = sreg;
+}
+
+uint8_t task__notify_begin(uint8_t mask, uint8_t all, uint16_t ticks) {
+  task_t *t = _task__current;
+  uint8_t sreg = SREG;
+  uint8_t suspended = 0;
+
+  cli();
+
+  if (!task__notified(t, mask, all)) {
+    t->notify_mask = mask;
+    if (all) {
+      t->flags |= TASK_FLAG_NOTIFY_ALL;
+    } else {
+      t->flags &= ~TASK_FLAG_NOTIFY_ALL;
+    }
+
+    task__suspend(0, ticks);
+    suspended = 1;
+  }
+
+  SREG = sreg;
+
+  return suspended;
+}
+
+uint8_t task__notify_end(uint8_t mask, uint8_t all) {
+  task_t *t = _task__current;
+  uint8_t sreg = SREG;
+  uint8_t bits = 0;
+
+  cli();
+
+  t->notify_mask = 0;
+
+  // Bits may have been set after a timeout, they count all the same.
+  if (task__notified(t, mask, all)) {
+    bits = t->notify & mask;
+    t->notify &= ~bits;
+  }
+
+  SREG = sreg;
+
+  return bits;
+}
+
+uint8_t task__notify_wait(uint8_t mask, uint8_t all, uint16_t ticks) {
+  uint8_t sreg = SREG;
+  uint8_t bits;
+
+  cli();
+  task__notify_begin(mask, all, ticks);
+  bits = task__notify_end(mask, all);
+  SREG = sreg;
+
+  return bits;
+}
+
+uint8_t task_notify_wait(uint8_t mask, uint8_t all) {
+  return task__notify_wait(mask, all, 0);
+}
+
+uint8_t task_notify_wait_timeout(uint8_t mask, uint8_t all, uint16_t ms) {
+  return task__notify_wait(mask, all, TASK_TIMEOUT_TICKS(ms));
+}
+
+uint8_t task_notify_take(uint8_t mask) {
+  uint8_t sreg = SREG;
+  uint8_t bits;
+
+  cli();
+  bits = _task__current->notify & mask;
+  _task__current->notify &= ~bits;
+  SREG = sreg;
+
+  return bits;
+}
+
+// Return state of task.
+uint8_t task_state(task_t *t) {
+  if (t == _task__current) {
+    return TASK_STATE_RUNNING;
+  }
+
+  return t->state;
+}
+
+// Put current task on the sleep queue for the specified number of ticks (at
+// least 1), without switching it out yet.
+// Must be called with interrupts disabled.
+static void task__sleep_begin(uint16_t ticks) {
+  task__runnable_remove(_task__current);
+  task__sleep_insert(&_task__current->timer, ticks);
+  _task__current->state = TASK_STATE_SLEEPING;
+
+  TRACE(TRACE_SLEEP, _task__current->id);
+}
+
+// Sleep current task for the specified number of ticks (at least 1).
+// Must be called with interrupts disabled.
+static void task__sleep(uint16_t ticks) {
+  task__sleep_begin(ticks);
+  task__yield();
+}
+
+// Make current task sleep for specified number of milliseconds.
+void task_sleep(uint16_t ms) {
+  uint16_t ticks = ms / MS_PER_TICK;
+  uint8_t sreg = SREG;
+
+  // Sleep until the next tick at the very least.
+  if (ticks == 0) {
+    ticks = 1;
+  }
+
+  cli();
+  task__sleep(ticks);
+  SREG = sreg;
+}
+
+void task__sleep_until_begin(uint32_t tick) {
+  uint8_t sreg = SREG;
+  int32_t ticks;
+
+  cli();
+
+  // The sleep queue holds delays of up to 16 bits.
+  ticks = tick - _task__ticks;
+  if (ticks > 0) {
+    task__sleep_begin(ticks > UINT16_MAX ? UINT16_MAX : ticks);
+  }
+
+  SREG = sreg;
+}
+
+void task_sleep_until(uint32_t tick) {
+  while ((int32_t)(tick - task_ticks()) > 0) {
+    task__sleep_until_begin(tick);
+    task__yield();
+  }
+}
+
+#if TASK_PERIODIC
+void task_set_period(task_t *t, uint16_t period) {
+  uint8_t sreg = SREG;
+
+  cli();
+  t->period = MS_TO_TICKS(period);
+  t->release = _task__ticks;
+  SREG = sreg;
+}
+
+void task_wait_period(void) {
+  task_t *t = _task__current;
+  uint8_t sreg = SREG;
+  uint16_t now, late, n;
+
+  cli();
+
+  now = _task__ticks;
+
+#if TASK_EDF
+  if (t->deadline && (int16_t)(now - (t->release + t->deadline)) > 0) {
+    t->misses++;
+  }
+#endif
+
+  if (t->period == 0) {
+    t->release = now;
+    SREG = sreg;
+    return;
+  }
+
+  t->release += t->period;
+
+  // Skip releases that have passed.
+  late = now - t->release;
+  if ((int16_t)late > 0) {
+    n = (late + t->period - 1) / t->period;
+    t->release += n * t->period;
+    t->overruns += n;
+  }
+
+  if (t->release != now) {
+    task__sleep(t->release - now);
+  }
+
+  SREG = sreg;
+}
+
+uint16_t task_overruns(task_t *t) {
+  uint8_t sreg = SREG;
+  uint16_t overruns;
+
+  cli();
+  overruns = t->overruns;
+  SREG = sreg;
+
+  return overruns;
+}
+#endif
+
+#if TASK_EDF
+void task_set_deadline(task_t *t, uint16_t deadline, uint16_t period) {
+  uint8_t sreg = SREG;
+
+  cli();
+  t->deadline = MS_TO_TICKS(deadline);
+  task_set_period(t, period);
+  SREG = sreg;
+}
+
+uint16_t task_deadline_misses(task_t *t) {
+  uint8_t sreg = SREG;
+  uint16_t misses;
+
+  cli();
+  misses = t->misses;
+  SREG = sreg;
+
+  return misses;
+}
+#endif // TASK_EDF
+
+// Terminate task. Must be called with interrupts disabled.
+static void task__exit(task_t *t) {
+  task__runnable_remove(t);
+  t->state = TASK_STATE_EXITED;
+
+  TRACE(TRACE_EXIT, t->id);
+
+  if (t->joiner) {
+    task_wakeup(t->joiner);
+  }
+
+  // The block can be reused even though this task is still running on it:
+  // interrupts stay disabled until the scheduler has switched stacks, and
+  // tasks are only created from task context.
+  if (t->flags & TASK_FLAG_DETACHED) {
+    QUEUE_INSERT_TAIL(&_tasks__free, &t->member);
+  }
+}
+
+// Terminate current task.
+void task_exit(void) {
+  cli();
+
+  task__exit(_task__current);
+
+  task_yield();
+
+  // Never reached.
+  for (;;) {
+    continue;
+  }
+}
+
+// Wait for task to terminate and release its block.
+void task_join(task_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  while (t->state != TASK_STATE_EXITED) {
+    t->joiner = _task__current;
+    task_suspend(0);
+  }
+
+  QUEUE_INSERT_TAIL(&_tasks__free, &t->member);
+
+  SREG = sreg;
+}
+
+// Release block of task as soon as it terminates.
+void task_detach(task_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (t->state == TASK_STATE_EXITED) {
+    QUEUE_INSERT_TAIL(&_tasks__free, &t->member);
+  } else {
+    t->flags |= TASK_FLAG_DETACHED;
+  }
+
+  SREG = sreg;
 }
@@ -12,28 +12,172 @@
 #define MS_PER_TICK 2
 #define US_PER_TICK (1000 * MS_PER_TICK)
 #define US_PER_COUNT (US_PER_TICK / COUNTS_PER_TICK)
+#define COUNTS_PER_SEC ((uint32_t)COUNTS_PER_TICK * (1000 / MS_PER_TICK))
+
+// Conversion between milliseconds and ticks, and microseconds and counts.
+#define MS_TO_TICKS(ms) ((ms) / MS_PER_TICK)
+#define TICKS_TO_MS(ticks) ((ticks) * MS_PER_TICK)
+#define US_TO_COUNTS(us) ((us) / US_PER_COUNT)
+#define COUNTS_TO_US(counts) ((counts) * US_PER_COUNT)
 
 #if F_CPU == 16000000L
 // Clock select: prescaler = 1/256
 #define _TCCR0B (_BV(CS02))
 #define COUNTS_PER_TICK ((F_CPU / 256) / (1000 / MS_PER_TICK))
+// Clock select when idle in tickless mode: prescaler = 1/1024
+#define _TCCR0B_IDLE (_BV(CS02) | _BV(CS00))
+#define IDLE_COUNT_SCALE 4
+// Every 4 ticks are a whole number of counts (125) at the idle prescaler.
+#define IDLE_TICKS_STEP 4
+#define IDLE_TICKS_MAX 8
 #elif F_CPU == 8000000L
 // Clock select: prescaler = 1/64
 #define _TCCR0B (_BV(CS01) | _BV(CS00))
 #define COUNTS_PER_TICK ((F_CPU / 64) / (1000 / MS_PER_TICK))
+// Clock select when idle in tickless mode: prescaler = 1/1024
+#define _TCCR0B_IDLE (_BV(CS02) | _BV(CS00))
+#define IDLE_COUNT_SCALE 16
+// Every 8 ticks are a whole number of counts (125) at the idle prescaler.
+#define IDLE_TICKS_STEP 8
+#define IDLE_TICKS_MAX 16
 #else
 #error "Unsupported F_CPU"
 #endif
 
+// Earliest deadline first scheduling releases jobs through the periodic API.
+#if TASK_EDF && !TASK_PERIODIC
+#undef TASK_PERIODIC
+#define TASK_PERIODIC 1
+#endif
+
+// Number of priority levels. Tasks with a higher priority are always
+// scheduled before tasks with a lower priority. Tasks with equal priority are
+// scheduled round-robin.
+#ifndef TASK_PRIORITIES
+#define TASK_PRIORITIES 8
+#endif
+
+#if TASK_PRIORITIES < 1 || TASK_PRIORITIES > 8
+#error "TASK_PRIORITIES must be between 1 and 8"
+#endif
+
+#define TASK_PRIORITY_MIN 0
+#define TASK_PRIORITY_MAX (TASK_PRIORITIES - 1)
+
+// Priority of tasks created through "task_create".
+#ifndef TASK_PRIORITY_DEFAULT
+#define TASK_PRIORITY_DEFAULT (TASK_PRIORITIES / 2)
+#endif
+
+// Number of ticks a task runs before it is preempted in favor of the next task
+// of equal priority, unless a task of equal or higher priority is woken up
+// first. Can be changed per task through "task_set_quantum".
+#ifndef TASK_QUANTUM
+#define TASK_QUANTUM 1
+#endif
+
+// Size of the region that task stacks are allocated from.
+// Every task takes its stack size plus sizeof(task_t) bytes from this region.
+#ifndef TASK_STACK_REGION_SIZE
+#define TASK_STACK_REGION_SIZE 0x500
+#endif
+
+// Stack size of tasks created through "task_create".
+#ifndef TASK_STACK_SIZE
+#define TASK_STACK_SIZE 0x100
+#endif
+
+// Smallest stack that fits the initial context of a task.
+#define TASK_STACK_SIZE_MIN 48
+
+// Stack checking (TASK_STACK_CHECK), only if specified.
+// Stacks are painted with TASK_STACK_PAINT when a task is created, such that
+// "task_stack_free" can tell how much of a stack was never used. When a task
+// is switched out, its saved stack pointer and the lowest byte of its stack
+// are checked, and "task_stack_overflow" is called if either is corrupt.
+#ifndef TASK_STACK_PAINT
+#define TASK_STACK_PAINT 0xa5
+#endif
+
+// Task states.
+// TASK_STATE_RUNNING is never stored, but returned by "task_state" for the
+// task that is currently running (which is also runnable).
+#define TASK_STATE_RUNNING 4
+#define TASK_STATE_RUNNABLE 0
+#define TASK_STATE_SUSPENDED 1
+#define TASK_STATE_SLEEPING 2
+#define TASK_STATE_EXITED 3
+
+// Task flags.
+#define TASK_FLAG_DETACHED 0x01 // Release block when task terminates.
+#define TASK_FLAG_TIMEOUT 0x02 // Woken up because its timeout expired.
+#define TASK_FLAG_NOTIFY_ALL 0x04 // Waiting for all bits of notify_mask.
+#define TASK_FLAG_COROUTINE 0x08 // Coroutine (see task_create_coroutine).
+#define TASK_FLAG_WAKEUP 0x10 // Wakeup deferred by the scheduler lock.
+
 typedef void (*task_fn)(void *);
 
+// Types of timeline entries.
+#define TASK_TNODE_TASK 0 // Task sleeping, or waiting with a timeout.
+#define TASK_TNODE_TIMER 1 // Software timer (see task_timer_start).
+#define TASK_TNODE_TIMER_DUE 2 // Software timer waiting for its callback.
+
+typedef struct task_tnode_s task_tnode_t;
+
+// Entry in the timeline of sleeping tasks and software timers, ordered by
+// expiry time. Its delay is relative to the entry before it.
+struct task_tnode_s {
+  QUEUE link; // Link in timeline.
+  uint16_t delay; // Ticks to expiry after the previous entry in the timeline.
+#if TASK_TIMERS
+  uint8_t type; // One of TASK_TNODE_*.
+#endif
+};
+
 typedef struct task_s task_t;
 
 struct task_s {
-  void *sp; // Stack pointer this task can be resumed from.
-  uint16_t delay; // Ticks until task can be scheduled again.
+  void *sp; // Stack pointer (or host context) this task can be resumed from.
+  uint8_t frame; // Type of context frame at sp. Must directly follow sp.
+  uint8_t state; // One of TASK_STATE_*.
+  uint8_t priority; // Effective priority (may be raised by a mutex waiter).
+  uint8_t base_priority; // Priority set by task creator.
+  uint8_t mutexes; // Number of mutexes held.
+  uint8_t flags; // Combination of TASK_FLAG_*.
+  uint8_t quantum; // Ticks to run before tasks of equal priority get a turn.
+  uint8_t slice; // Ticks left of quantum.
+  uint8_t *stack; // Lowest address of stack.
+  uint16_t stack_size; // Size of stack in bytes.
+  task_t *joiner; // Task waiting for this task to terminate.
+  uint8_t notify; // Pending notification bits.
+  uint8_t notify_mask; // Notification bits waited for (0 if not waiting).
+#if TASK_HANDOFF
+  task_t *handoff; // Task to yield to when the last mutex is unlocked.
+#endif
+#if TASK_LOCK
+  uint8_t lock; // Scheduler lock depth while switched out.
+  task_t *lock_next; // Next task with a deferred wakeup.
+#endif
+#if TASK_TRACE
+  uint8_t id; // Identifies task in trace records.
+#endif
+#if TASK_PERIODIC
+  uint16_t period; // Period in ticks (0 if none).
+  uint16_t release; // Tick of the current release (lower 16 bits).
+  uint16_t overruns; // Number of releases skipped because the task was late.
+#endif
+#if TASK_EDF
+  uint16_t deadline; // Relative deadline in ticks (0 if none).
+  uint16_t misses; // Number of jobs that finished after their deadline.
+#endif
+#if TASK_STATS
+  task_t *next; // Next task in list of all tasks.
+  uint32_t runtime; // Timer counts spent running.
+  uint16_t switches; // Number of times switched to.
+#endif
 
-  QUEUE member;
+  QUEUE member; // Link in run queue or wait queue.
+  task_tnode_t timer; // Entry in timeline (also while waiting with a timeout).
 };
 
 // Initialize internal structures, tick timer, etc.
@@ -42,26 +186,564 @@ void task_init(void);
 // Creates a task for the specified function.
 task_t *task_create(task_fn fn, void *data);
 
+// Creates a task for the specified function with the specified priority.
+task_t *task_create_priority(task_fn fn, void *data, uint8_t priority);
+
+// Creates a task for the specified function with the specified stack size.
+// The task creation functions return NULL if the stack size is smaller than
+// TASK_STACK_SIZE_MIN or if the stack region is exhausted.
+task_t *task_create_ex(task_fn fn, void *data, uint16_t stack_size);
+
+// Terminate current task. Never returns.
+// A task also terminates when its task function returns.
+// The task must not hold any mutexes.
+void task_exit(void) __attribute__((noreturn));
+
+// Wait for task to terminate.
+// Its stack and task struct are then reused by the next task that is created
+// with a stack that fits. Only one task can join a task, and only once.
+void task_join(task_t *t);
+
+// Release stack and task struct of task as soon as it terminates.
+// Use this for tasks that nobody joins. A detached task cannot be joined.
+void task_detach(task_t *t);
+
 // Starts task execution. Never returns.
 void task_start(void);
 
+// Static tasks (TASK_STATIC_TASKS), only if specified.
+// Tasks declared with TASK_STATIC have their task struct and stack allocated
+// by the linker, so that their RAM shows up in the size of the program. The
+// program defines a table of them in program memory, and "task_init" starts
+// every task in it, in order. Static tasks are created like any other task:
+// they can exit, and be joined or detached.
+//
+//   TASK_STATIC(blink, 128);
+//   TASK_STATIC(delay, 64);
+//
+//   TASK_STATIC_TABLE = {
+//     TASK_STATIC_ENTRY(blink, blink_task, NULL, TASK_PRIORITY_DEFAULT),
+//     TASK_STATIC_ENTRY(delay, delay_task, NULL, TASK_PRIORITY_DEFAULT),
+//     TASK_STATIC_END,
+//   };
+//
+// The task struct of a static task is available as the declared name. Set
+// TASK_STACK_REGION_SIZE to 0 if all tasks are static.
+#if TASK_STATIC_TASKS
+#include <avr/pgmspace.h>
+
+typedef struct task_static_s task_static_t;
+
+struct task_static_s {
+  task_t *task; // Task struct (NULL for the end of the table).
+  uint8_t *stack; // Lowest address of stack.
+  uint16_t stack_size; // Size of stack in bytes.
+  task_fn fn;
+  void *data;
+  uint8_t priority;
+};
+
+// Static task structs and stacks are initialized by "task_init", and need
+// not be cleared at startup.
+#if TASK_HOST
+#define TASK_NOINIT
+#else
+#define TASK_NOINIT __attribute__((section(".noinit")))
+#endif
+
+// Declare task struct and stack of a static task.
+// Fails to compile if the stack is smaller than TASK_STACK_SIZE_MIN.
+#define TASK_STATIC(name, stack_size) \
+  typedef char name##_stack_check[(stack_size) >= TASK_STACK_SIZE_MIN ? 1 : -1]; \
+  task_t name TASK_NOINIT; \
+  static uint8_t name##_stack[stack_size] TASK_NOINIT
+
+#define TASK_STATIC_TABLE const task_static_t task_static_table[] PROGMEM
+
+#define TASK_STATIC_ENTRY(name, fn, data, priority) \
+  { &name, name##_stack, sizeof(name##_stack), fn, data, priority }
+
+#define TASK_STATIC_END { 0 }
+
+// Table of static tasks, defined by the program with TASK_STATIC_TABLE.
+extern const task_static_t task_static_table[] PROGMEM;
+#endif
+
 // Yield control from current task.
 void task_yield(void);
 
 // Return pointer to current task.
 task_t *task_current(void);
 
+// Change priority of task.
+// If the task holds a mutex it may keep running at a higher priority until it
+// releases that mutex (see mutex.h).
+void task_set_priority(task_t *t, uint8_t priority);
+
+// Change quantum of task (see TASK_QUANTUM).
+// Use a long quantum for compute-heavy tasks to reduce switching overhead.
+void task_set_quantum(task_t *t, uint8_t ticks);
+
+// Yield to task t right away, ahead of other tasks of its priority. Does
+// nothing if t is not runnable or its priority is lower than that of the
+// current task. The current task stays runnable.
+// From a timer function or a TASK_ISR handler, the switch happens when it
+// returns.
+void task_yield_to(task_t *t);
+
+// Scheduler lock (TASK_LOCK), only if specified.
+// While the current task holds the lock, it is not preempted and does not
+// yield to tasks it wakes up, but interrupts stay enabled. Interrupt handlers
+// may run, but the ticks and wakeups they cause are only applied when the lock
+// is released, after which the task switches if it would have been preempted
+// in the meantime. This protects state that is shared between tasks, but not
+// with interrupt handlers, without adding to interrupt latency.
+//
+// Locks nest. A task that blocks while holding the lock (e.g. in mutex_lock)
+// gets it back when it is resumed, and other tasks run unlocked in between.
+// It must not exit while holding it. Interrupt handlers are told apart from
+// the task holding the lock by interrupts being disabled, so that task must
+// not call "task_wakeup" with interrupts disabled.
+//
+// mutex.c and cond.c use the lock instead of disabling interrupts.
+void task_lock(void);
+void task_unlock(void);
+
+// Protect kernel state in mutex.c and cond.c: with the scheduler lock if
+// TASK_LOCK is specified, else by disabling interrupts.
+#if TASK_LOCK
+#define TASK__ENTER(sreg) do { (sreg) = 0; task_lock(); } while (0)
+#define TASK__LEAVE(sreg) do { (void)(sreg); task_unlock(); } while (0)
+#else
+#define TASK__ENTER(sreg) do { (sreg) = SREG; cli(); } while (0)
+#define TASK__LEAVE(sreg) do { SREG = (sreg); } while (0)
+#endif
+
+// Yield like "task_yield" after the current task was made to wait, unless it
+// is a coroutine, which returns to the scheduler by itself.
+void task__yield(void);
+
+// Return whether the caller runs as the current task, and not in a timer
+// function or a TASK_ISR handler (which see the task they interrupted as
+// current). Used by cond.c.
+uint8_t task__in_task(void);
+
+// Change effective priority of task without changing its base priority.
+// Used by mutex.c for priority inheritance.
+void task__set_effective_priority(task_t *t, uint8_t priority);
+
 // Suspend task until it is woken up explicitly.
-// The task is added to the tail of the queue pointed to by q. If q is NULL,
-// it is added to the system wide queue for suspended tasks.
+// The task is added to the queue pointed to by q, behind all tasks of equal or
+// higher priority. If q is NULL, it is added to the system wide queue for
+// suspended tasks.
 void task_suspend(QUEUE *h);
 
+// Suspend task like "task_suspend", for at most the specified number of
+// milliseconds (but at least until the next tick). Returns 0 if the task was
+// woken up, or -1 if it timed out, in which case it is no longer in the queue.
+int8_t task_suspend_timeout(QUEUE *h, uint16_t ms);
+
+// Suspend task like "task_suspend_timeout", for at most the specified number
+// of ticks, or without timeout if ticks is 0. Used by mutex.c, cond.c and the
+// drivers, which convert their timeouts with TASK_TIMEOUT_TICKS.
+int8_t task__suspend(QUEUE *h, uint16_t ticks);
+
+// Convert timeout in milliseconds to ticks (at least 1) for "task__suspend".
+#define TASK_TIMEOUT_TICKS(ms) ((ms) < MS_PER_TICK ? 1 : MS_TO_TICKS(ms))
+
 // Wake up task.
 void task_wakeup(task_t *t);
 
+// Switch to the highest priority runnable task right away if its priority is
+// higher than that of the interrupted task, instead of at the next tick.
+// Call this last in an interrupt handler that woke up or notified a task.
+// The interrupted task is switched out with the handler's registers still on
+// its stack, and finishes the handler when it is resumed. With TASK_ISR_YIELD
+// defined, the uart, i2c and sirc drivers call it from their handlers.
+void task_yield_from_isr(void);
+
+// Interrupt stack (TASK_ISR_STACK), only if specified.
+// Interrupt handlers defined with TASK_ISR switch to a shared interrupt stack
+// of TASK_ISR_STACK_SIZE bytes after saving the call-clobbered registers, so
+// that task stacks need no room for the handler itself. The tick handler runs
+// on it as well. Handlers run with interrupts disabled and never nest. Without
+// TASK_ISR_STACK, TASK_ISR is the same as ISR.
+//
+// "task_yield_from_isr" switches tasks when the handler is back on the stack
+// of the interrupted task.
+//
+//   TASK_ISR(USART_RX_vect) {
+//     ...
+//   }
+//
+#ifndef TASK_ISR_STACK_SIZE
+#define TASK_ISR_STACK_SIZE 96
+#endif
+
+#if TASK_ISR_STACK && !TASK_HOST
+// Stack pointer of the interrupted task (0 when not in a handler).
+extern void *_task__isr_sp;
+extern uint8_t _task__isr_stack[TASK_ISR_STACK_SIZE];
+
+// Called when back on the stack of the interrupted task.
+void task__isr_exit(void);
+
+static inline void task__isr_enter(void) __attribute__((always_inline));
+static inline void task__isr_enter(void) {
+  asm volatile(
+    "push r0\n"
+    "in r0, 0x3f\n"
+    "push r0\n"
+    "push r1\n"
+    "push r18\n"
+    "push r19\n"
+    "push r20\n"
+    "push r21\n"
+    "push r22\n"
+    "push r23\n"
+    "push r24\n"
+    "push r25\n"
+    "push r26\n"
+    "push r27\n"
+    "push r30\n"
+    "push r31\n"
+    "clr r1\n"
+
+    // Save stack pointer and switch to the interrupt stack.
+    "in r24, 0x3d\n"
+    "in r25, 0x3e\n"
+    "sts _task__isr_sp, r24\n"
+    "sts _task__isr_sp+1, r25\n"
+    "ldi r24, lo8(_task__isr_stack+%0)\n"
+    "ldi r25, hi8(_task__isr_stack+%0)\n"
+    "out 0x3d, r24\n"
+    "out 0x3e, r25\n"
+    :: "i" (TASK_ISR_STACK_SIZE - 1)
+  );
+}
+
+static inline void task__isr_leave(void) __attribute__((always_inline));
+static inline void task__isr_leave(void) {
+  asm volatile(
+    // Switch back to the stack of the interrupted task.
+    "lds r24, _task__isr_sp\n"
+    "lds r25, _task__isr_sp+1\n"
+    "out 0x3d, r24\n"
+    "out 0x3e, r25\n"
+    "sts _task__isr_sp, r1\n"
+    "sts _task__isr_sp+1, r1\n"
+
+    "call task__isr_exit\n"
+
+    "pop r31\n"
+    "pop r30\n"
+    "pop r27\n"
+    "pop r26\n"
+    "pop r25\n"
+    "pop r24\n"
+    "pop r23\n"
+    "pop r22\n"
+    "pop r21\n"
+    "pop r20\n"
+    "pop r19\n"
+    "pop r18\n"
+    "pop r1\n"
+    "pop r0\n"
+    "out 0x3f, r0\n"
+    "pop r0\n"
+    "reti\n"
+  );
+}
+
+// The handler body must not be inlined into the naked handler, it saves the
+// call-saved registers it uses itself.
+#define TASK_ISR(vector) \
+  static void vector##_isr(void) __attribute__((noinline, used)); \
+  ISR(vector, ISR_NAKED) { \
+    task__isr_enter(); \
+    vector##_isr(); \
+    task__isr_leave(); \
+  } \
+  static void vector##_isr(void)
+#else
+#define TASK_ISR(vector) ISR(vector)
+#endif
+
+// Notifications.
+// Every task has 8 notification bits. Other tasks and interrupt handlers set
+// them with "task_notify", and they stay pending until the task consumes them
+// by waiting for them. A notification is never lost, also when it is sent
+// before the task starts waiting. The drivers in this repository use bits 0-3
+// by default (see uart.h, i2c.h and drivers/sirc.h), applications bits 4-7.
+#define TASK_NOTIFY_ANY 0 // Wait for any of the bits.
+#define TASK_NOTIFY_ALL 1 // Wait for all of the bits.
+
+// Set notification bits of task, and wake it up if it is waiting for them.
+// Can be called from interrupt handlers.
+void task_notify(task_t *t, uint8_t bits);
+
+// Wait for any or all (see TASK_NOTIFY_*) of the bits in mask to be pending.
+// Returns the pending bits in mask, which are cleared.
+uint8_t task_notify_wait(uint8_t mask, uint8_t all);
+
+// Wait like "task_notify_wait", for at most the specified number of
+// milliseconds. Returns 0 if it timed out, and no bits are cleared.
+uint8_t task_notify_wait_timeout(uint8_t mask, uint8_t all, uint16_t ms);
+
+// Wait like "task_notify_wait", for at most the specified number of ticks, or
+// without timeout if ticks is 0. Used by the drivers.
+uint8_t task__notify_wait(uint8_t mask, uint8_t all, uint16_t ticks);
+
+// The two halves of "task__notify_wait". The first suspends the task unless
+// the bits are pending, and returns whether it did. The second takes the
+// bits once the task runs again. Used by TASK_CO_NOTIFY_WAIT.
+uint8_t task__notify_begin(uint8_t mask, uint8_t all, uint16_t ticks);
+uint8_t task__notify_end(uint8_t mask, uint8_t all);
+
+// Clear and return the pending bits in mask without waiting.
+uint8_t task_notify_take(uint8_t mask);
+
+// Return state of task (one of TASK_STATE_*).
+uint8_t task_state(task_t *t);
+
 // Sleep current task for specified number of milliseconds.
 void task_sleep(uint16_t ms);
 
+// Sleep current task until the specified tick (see task_ticks).
+// Returns immediately if that tick has passed.
+void task_sleep_until(uint32_t tick);
+
+// Put current task to sleep until the specified tick, or for UINT16_MAX ticks
+// if that is further away, without switching it out yet. Does nothing if the
+// tick has passed. Used by task_sleep_until and TASK_CO_SLEEP_UNTIL.
+void task__sleep_until_begin(uint32_t tick);
+
+// Periodic tasks (TASK_PERIODIC), only if specified or if TASK_EDF is.
+#if TASK_PERIODIC
+// Make task periodic with the specified period in milliseconds (at most
+// 32767 ticks), released now. A period of 0 makes it aperiodic again.
+void task_set_period(task_t *t, uint16_t period);
+
+// Sleep current task until its next release. Releases are exact multiples of
+// the period after the first one on the tick timeline, so a periodic task
+// doesn't drift. If the task is late, releases that have passed are skipped
+// and counted as overruns, and the task stays in phase. An aperiodic task is
+// released again immediately.
+void task_wait_period(void);
+
+// Return number of releases of task that were skipped (see task_wait_period).
+uint16_t task_overruns(task_t *t);
+#endif
+
+// Earliest deadline first scheduling (TASK_EDF), only if specified.
+// Of the runnable tasks with the highest priority, the task with the earliest
+// absolute deadline runs first. Tasks without a deadline run after those with
+// one, round-robin. Give all tasks with a deadline the same priority to have
+// them scheduled by deadline only. Deadlines can be at most 32767 ticks.
+#if TASK_EDF
+// Set relative deadline and period of task in milliseconds, and release its
+// first job now (see task_set_period). A deadline of 0 removes the deadline.
+// A job that finishes after its deadline is counted as a deadline miss when
+// the task calls task_wait_period.
+void task_set_deadline(task_t *t, uint16_t deadline, uint16_t period);
+
+// Return number of jobs of task that finished after their deadline.
+uint16_t task_deadline_misses(task_t *t);
+#endif
+
+// Software timers (TASK_TIMERS), only if specified.
+// A timer calls a function once or periodically without needing a task (and
+// its stack). Timers are kept in the same timeline as sleeping tasks. When
+// they expire, the scheduler calls their functions on its own stack, with
+// interrupts disabled, before it picks the next task to run. Like interrupt
+// handlers, timer functions must be short and must not block, but they can
+// wake up and notify tasks, and start and stop timers.
+#if TASK_TIMERS
+typedef void (*task_timer_fn)(void *);
+
+typedef struct task_timer_s task_timer_t;
+
+struct task_timer_s {
+  task_tnode_t node; // Entry in timeline, or in list of due timers.
+  uint16_t period; // Period in ticks (0 for a one-shot timer).
+  task_timer_fn fn;
+  void *data;
+};
+
+// Initialize timer that calls fn with data when it expires.
+void task_timer_init(task_timer_t *t, task_timer_fn fn, void *data);
+
+// Start (or restart) timer to expire after the specified number of
+// milliseconds, and then every period milliseconds if period is not 0.
+// A periodic timer doesn't drift; if its function is called late, expiries
+// that passed in the meantime are skipped.
+void task_timer_start(task_timer_t *t, uint16_t ms, uint16_t period);
+
+// Stop timer. Its function is not called anymore, even if it expired.
+void task_timer_stop(task_timer_t *t);
+
+// Return whether timer is started and its function is still to be called.
+uint8_t task_timer_active(task_timer_t *t);
+#endif
+
+// Coroutines (TASK_COROUTINES), only if specified.
+// A coroutine is a task without a stack, scheduled like any other task. The
+// scheduler calls its function on the scheduler stack, with interrupts
+// enabled, and the function returns when it blocks, yields or terminates.
+// It is not preempted by the tick, so it must return often. Its state lives
+// in a struct passed as data, with a task_co_t that records where to resume,
+// in the style of protothreads: the function body is a switch on the line
+// number of the last TASK_CO_* statement it returned from. Local variables
+// don't survive these statements, and there can be at most one per line.
+//
+// A coroutine block is the task struct plus 4 bytes, instead of a stack of
+// TASK_STACK_SIZE bytes. Coroutines must not call blocking functions directly,
+// only through the TASK_CO_* wrappers here, in mutex.h, cond.h and uart.h.
+#if TASK_COROUTINES
+#define TASK_CO_WAITING 0 // Returned when blocked or yielding.
+#define TASK_CO_EXITED 1 // Returned when terminated.
+
+typedef uint8_t (*task_co_fn)(void *);
+
+typedef struct task_co_s task_co_t;
+
+struct task_co_s {
+  uint16_t lc; // Line to resume at (0 to start at the top).
+  uint32_t tick; // Tick to sleep until (see TASK_CO_SLEEP_UNTIL).
+};
+
+// Creates a coroutine for the specified function, called with data until it
+// returns TASK_CO_EXITED. Returns NULL if the stack region is exhausted.
+task_t *task_create_coroutine(task_co_fn fn, void *data);
+
+#define TASK_CO_BEGIN(co) switch ((co)->lc) { case 0:
+
+#define TASK_CO_END(co) } (co)->lc = 0; return TASK_CO_EXITED
+
+// Return to the scheduler, and resume here when runnable again.
+#define TASK_CO_YIELD(co)                                                     \
+  do {                                                                        \
+    (co)->lc = __LINE__;                                                      \
+    return TASK_CO_WAITING;                                                   \
+    case __LINE__:;                                                           \
+  } while (0)
+
+#define TASK_CO_EXIT(co)                                                      \
+  do {                                                                        \
+    (co)->lc = 0;                                                             \
+    return TASK_CO_EXITED;                                                    \
+  } while (0)
+
+#define TASK_CO_SLEEP(co, ms)                                                 \
+  do {                                                                        \
+    task_sleep(ms);                                                           \
+    TASK_CO_YIELD(co);                                                        \
+  } while (0)
+
+// The tick is evaluated once, and kept in co across the sleep.
+#define TASK_CO_SLEEP_UNTIL(co, t)                                            \
+  do {                                                                        \
+    (co)->tick = (t);                                                         \
+    while ((int32_t)((co)->tick - task_ticks()) > 0) {                        \
+      task__sleep_until_begin((co)->tick);                                    \
+      TASK_CO_YIELD(co);                                                      \
+    }                                                                         \
+  } while (0)
+
+#if TASK_PERIODIC
+#define TASK_CO_WAIT_PERIOD(co)                                               \
+  do {                                                                        \
+    task_wait_period();                                                       \
+    TASK_CO_YIELD(co);                                                        \
+  } while (0)
+#endif
+
+#define TASK_CO_SUSPEND(co, h)                                                \
+  do {                                                                        \
+    task_suspend(h);                                                          \
+    TASK_CO_YIELD(co);                                                        \
+  } while (0)
+
+// Suspend until woken up, or for at most ms milliseconds. Stores 0 in rv if
+// the coroutine was woken up, or -1 if it timed out.
+#define TASK_CO_SUSPEND_TIMEOUT(co, h, ms, rv)                                \
+  do {                                                                        \
+    task_suspend_timeout(h, ms);                                              \
+    TASK_CO_YIELD(co);                                                        \
+    (rv) = (task_current()->flags & TASK_FLAG_TIMEOUT) ? -1 : 0;              \
+  } while (0)
+
+// Wait for notification bits without timeout (ms 0) or for at most ms
+// milliseconds, and store the bits taken in bits (see task_notify_wait).
+#define TASK_CO_NOTIFY_WAIT(co, bits, mask, all, ms)                          \
+  do {                                                                        \
+    if (task__notify_begin(mask, all, (ms) ? TASK_TIMEOUT_TICKS(ms) : 0)) {   \
+      TASK_CO_YIELD(co);                                                      \
+    }                                                                         \
+    (bits) = task__notify_end(mask, all);                                     \
+  } while (0)
+#endif
+
+// Tickless idle mode (TASK_TICKLESS), only if specified.
+// When no task is runnable, the tick timer is slowed down such that it only
+// fires when the first sleeping task is due (or after IDLE_TICKS_MAX ticks).
+// Time that passed is accounted for when the processor wakes up.
+
+#if TASK_STACK_CHECK
+// Return number of bytes at the bottom of the task's stack that were never
+// used since the task was created (its minimum free stack).
+uint16_t task_stack_free(task_t *t);
+
+// Called from the scheduler with interrupts disabled when the stack of a task
+// that was just switched out has overflowed. The default implementation halts.
+// If this function returns, the task is suspended and never resumed.
+void task_stack_overflow(task_t *t);
+#endif
+
+// Statistics (TASK_STATS), only if specified.
+// Run time is kept per task, and idle time for the system, in timer counts
+// (see COUNTS_PER_SEC). Time is accounted for whenever the scheduler runs.
+#if TASK_STATS
+typedef struct task_stat_s task_stat_t;
+
+struct task_stat_s {
+  task_t *task;
+  uint8_t state; // One of TASK_STATE_*.
+  uint8_t priority; // Effective priority.
+  uint16_t switches; // Number of times switched to.
+  uint32_t runtime; // Timer counts spent running.
+};
+
+typedef struct task_stats_s task_stats_t;
+
+struct task_stats_s {
+  uint32_t idle; // Timer counts spent without a runnable task.
+  uint16_t switches; // Number of switches to a task.
+  uint16_t wakeups; // Number of tasks made runnable by "task_wakeup".
+  uint16_t preemptions; // Number of times the tick switched out a task.
+};
+
+// Take snapshot of statistics without stopping the system.
+// Copies system wide statistics to sys (if not NULL), and statistics of up
+// to len tasks to stats. Returns the number of tasks, which may be larger
+// than len. Terminated tasks are skipped.
+uint8_t task_stats(task_stats_t *sys, task_stat_t *stats, uint8_t len);
+#endif
+
+#if TASK_TRACE
+// Return timer counts since task_init, truncated to 16 bits (see trace.h).
+// Must be called with interrupts disabled.
+uint16_t task__trace_clock(void);
+#endif
+
+// Return number of ticks and timer counts since task_init.
+// Both account for a tick that is pending, so they never go backwards, and
+// both can be called from interrupt handlers. A count takes US_PER_COUNT
+// (16us at 16MHz). Take the difference of two values to measure time; it is
+// correct across wraparound (counts wrap every 19 hours at 16MHz).
+uint32_t task_ticks(void);
+uint32_t task_counts(void);
+
 // Only count seconds if specified
 #if TASK_COUNT_SEC
 #ifndef TASK_SEC_T
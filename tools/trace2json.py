@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# Convert trace dumps written by trace_dump() (see trace.h) into the Chrome
+# trace event format, which can be loaded by chrome://tracing and Perfetto.
+#
+# Usage: trace2json.py [--us-per-count N] [dump] > trace.json
+#
+# The dump may contain other output (e.g. from printf) between trace dumps;
+# everything up to the next header is skipped. Multiple dumps are concatenated
+# into a single timeline.
+#
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"\xa5\x5a"
+
+SWITCH_IN = 1
+SWITCH_OUT = 2
+WAKEUP = 3
+SUSPEND = 4
+SLEEP = 5
+EXIT = 6
+TICK = 7
+IDLE = 8
+MUTEX_WAIT = 9
+
+NAMES = {
+    WAKEUP: "wakeup",
+    SUSPEND: "suspend",
+    SLEEP: "sleep",
+    EXIT: "exit",
+    TICK: "tick",
+    IDLE: "idle",
+    MUTEX_WAIT: "mutex wait",
+}
+
+
+def records(data):
+    pos = 0
+    while True:
+        pos = data.find(MAGIC, pos)
+        if pos < 0 or pos + 4 > len(data):
+            return
+        (count,) = struct.unpack_from("<H", data, pos + 2)
+        pos += 4
+        for _ in range(count):
+            if pos + 4 > len(data):
+                return
+            yield struct.unpack_from("<BBH", data, pos)
+            pos += 4
+
+
+def convert(data, us_per_count):
+    events = []
+    running = {}
+    clock = None
+    base = 0
+
+    def name(task):
+        return "task %d" % task
+
+    for event, arg, time in records(data):
+        # Unwrap the 16 bit timestamp. Records are at most one wrap apart,
+        # because a tick is recorded every few milliseconds.
+        if clock is not None and time < clock:
+            base += 1 << 16
+        clock = time
+        ts = (base + time) * us_per_count
+
+        if event == SWITCH_IN:
+            running[arg] = ts
+        elif event == SWITCH_OUT:
+            start = running.pop(arg, None)
+            if start is not None:
+                events.append({
+                    "name": name(arg),
+                    "ph": "X",
+                    "ts": start,
+                    "dur": ts - start,
+                    "pid": 0,
+                    "tid": arg,
+                })
+        elif event in (TICK, IDLE):
+            events.append({
+                "name": NAMES[event],
+                "ph": "i",
+                "s": "p",
+                "ts": ts,
+                "pid": 0,
+                "tid": 0,
+                "args": {"ticks": arg} if event == TICK else {},
+            })
+        else:
+            events.append({
+                "name": NAMES.get(event, "event %d" % event),
+                "ph": "i",
+                "s": "t",
+                "ts": ts,
+                "pid": 0,
+                "tid": arg,
+            })
+
+    tids = {e["tid"] for e in events}
+    for tid in sorted(tids):
+        events.append({
+            "name": "thread_name",
+            "ph": "M",
+            "pid": 0,
+            "tid": tid,
+            "args": {"name": name(tid) if tid else "scheduler"},
+        })
+
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("dump", nargs="?", help="raw dump (default: stdin)")
+    parser.add_argument("--us-per-count", type=float, default=16.0,
+                        help="microseconds per timer count (default: 16, "
+                             "for a 16MHz clock)")
+    args = parser.parse_args()
+
+    if args.dump:
+        with open(args.dump, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    json.dump(convert(data, args.us_per_count), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
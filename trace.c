@@ -0,0 +1,97 @@
+#include <avr/interrupt.h>
+
+#include "task.h"
+#include "trace.h"
+#include "uart.h"
+
+#if TASK_TRACE
+
+struct trace_record_s {
+  uint8_t event;
+  uint8_t arg;
+  uint16_t time;
+};
+
+static struct trace_record_s trace_buf[TRACE_SIZE];
+
+// Index of oldest record.
+static uint8_t trace_head = 0;
+
+// Number of records in buffer.
+static uint8_t trace_count = 0;
+
+void trace__record(uint8_t event, uint8_t arg) {
+  struct trace_record_s *r;
+  uint8_t sreg;
+  uint8_t i;
+
+  sreg = SREG;
+  cli();
+
+  i = trace_head + trace_count;
+  if (i >= TRACE_SIZE) {
+    i -= TRACE_SIZE;
+  }
+
+  if (trace_count < TRACE_SIZE) {
+    trace_count++;
+  } else {
+    // Overwrite oldest record.
+    if (++trace_head == TRACE_SIZE) {
+      trace_head = 0;
+    }
+  }
+
+  r = &trace_buf[i];
+  r->event = event;
+  r->arg = arg;
+  r->time = task__trace_clock();
+
+  SREG = sreg;
+}
+
+void trace_dump(void) {
+  struct trace_record_s chunk[8];
+  uint8_t header[4];
+  uint8_t sreg;
+  uint8_t left;
+  uint8_t n;
+  uint8_t i;
+
+  // Only dump what was recorded up to now, or this never ends.
+  sreg = SREG;
+  cli();
+  left = trace_count;
+  SREG = sreg;
+
+  header[0] = TRACE_MAGIC0;
+  header[1] = TRACE_MAGIC1;
+  header[2] = left;
+  header[3] = 0;
+  uart_write(header, sizeof(header));
+
+  while (left) {
+    n = left;
+    if (n > sizeof(chunk) / sizeof(chunk[0])) {
+      n = sizeof(chunk) / sizeof(chunk[0]);
+    }
+
+    // Records are taken from the head, so records that were overwritten
+    // while writing the previous chunk are skipped.
+    sreg = SREG;
+    cli();
+    for (i = 0; i < n; i++) {
+      chunk[i] = trace_buf[trace_head];
+      if (++trace_head == TRACE_SIZE) {
+        trace_head = 0;
+      }
+      trace_count--;
+    }
+    SREG = sreg;
+
+    uart_write(chunk, n * sizeof(chunk[0]));
+    left -= n;
+  }
+}
+
+#endif // TASK_TRACE
@@ -0,0 +1,63 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Scheduler event trace.
+ *
+ * When TASK_TRACE is defined, the scheduler and synchronization primitives
+ * record events in a ring buffer of TRACE_SIZE records. When the buffer is
+ * full, the oldest record is overwritten. Every record takes 4 bytes:
+ *
+ *   uint8_t  event  (one of TRACE_*)
+ *   uint8_t  arg    (task id for most events, see below)
+ *   uint16_t time   (timer counts since task_init, little endian, wrapping)
+ *
+ * Task ids are assigned when a task is created, starting at 1. Id 0 means no
+ * task. The buffer is drained with "trace_dump", which writes a header
+ * followed by all records recorded up to that point through "uart_write".
+ * The header is TRACE_MAGIC0, TRACE_MAGIC1 and the number of records as
+ * 16 bit little endian integer. Use tools/trace2json.py to convert a dump to a
+ * timeline that can be loaded by chrome://tracing or Perfetto.
+ *
+ * Ticks and idle passes (TRACE_TICK and TRACE_IDLE) are only recorded when
+ * TASK_TRACE_TICKS is defined as well. Every tick would take a record, so the
+ * buffer would only hold the last TRACE_SIZE ticks of history.
+ */
+
+#include <stdint.h>
+
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 64
+#endif
+
+#if TRACE_SIZE > 255
+#error "TRACE_SIZE must be smaller than 256"
+#endif
+
+#define TRACE_MAGIC0 0xa5
+#define TRACE_MAGIC1 0x5a
+
+#define TRACE_SWITCH_IN 1 // arg: task that is switched to
+#define TRACE_SWITCH_OUT 2 // arg: task that is switched out
+#define TRACE_WAKEUP 3 // arg: task that is woken up
+#define TRACE_SUSPEND 4 // arg: task that suspends
+#define TRACE_SLEEP 5 // arg: task that sleeps
+#define TRACE_EXIT 6 // arg: task that terminates
+#define TRACE_TICK 7 // arg: number of ticks that passed (TASK_TRACE_TICKS)
+#define TRACE_IDLE 8 // arg: 0 (TASK_TRACE_TICKS)
+#define TRACE_MUTEX_WAIT 9 // arg: task holding the mutex
+
+#if TASK_TRACE
+#define TRACE(event, arg) trace__record(event, arg)
+
+// Record event. May be called from interrupt handlers.
+void trace__record(uint8_t event, uint8_t arg);
+
+// Write all records to UART and remove them from the buffer.
+// Events recorded while writing are kept for the next dump.
+void trace_dump(void);
+#else
+#define TRACE(event, arg) do { } while (0)
+#endif
+
+#endif
@@ -123,7 +123,7 @@ void uart_init(uint16_t ubrr, uint8_t x2) {
 }
 
 // Transmit interrupt handler.
-ISR(USART_UDRE_vect) {
+TASK_ISR(USART_UDRE_vect) {
 #ifdef UART_COUNT_TX_BYTES
   // The TX counter should be incremented from the TX complete interrupt
   // handler, but it is overkill to have a handler just for this.
@@ -135,18 +135,22 @@ ISR(USART_UDRE_vect) {
   } else {
     // Disable USART Data Register Empty Interrupt
     UCSR0B &= ~_B(UDRIE0, 1);
-    task_wakeup(tx_task);
+    task_notify(tx_task, UART_NOTIFY_TX);
+#if TASK_ISR_YIELD
+    task_yield_from_isr();
+#endif
   }
 }
 
-// Write data to UART.
-int uart_write(const void *buf, size_t count) {
+// Start writing data; the task is notified when done.
+void uart_write_begin(const void *buf, size_t count) {
   uint8_t sreg;
 
   sreg = SREG;
   cli();
 
   tx_task = task_current();
+  task_notify_take(UART_NOTIFY_TX);
   tx_buf = buf;
   tx_count = count;
 
@@ -154,16 +158,21 @@ int uart_write(const void *buf, size_t count) {
   // It is disabled by the interrupt handler when done.
   UCSR0B |= _B(UDRIE0, 1);
 
-  // Task is woken up by the interrupt handler when done.
-  task_suspend(NULL);
-
   SREG = sreg;
+}
+
+// Write data to UART.
+int uart_write(const void *buf, size_t count) {
+  uart_write_begin(buf, count);
+
+  // Task is notified by the interrupt handler when done.
+  task_notify_wait(UART_NOTIFY_TX, TASK_NOTIFY_ANY);
 
   return count;
 }
 
 // Receive interrupt handler.
-ISR(USART_RX_vect) {
+TASK_ISR(USART_RX_vect) {
   // Check for receive errors.
   if (UCSR0A & (_BV(FE0) | _BV(DOR0) | _BV(UPE0))) {
 #ifdef UART_COUNT_RX_ERRORS
@@ -209,15 +218,19 @@ ISR(USART_RX_vect) {
     rx_buf++;
   } else {
     rx_buf = NULL;
-    task_wakeup(rx_task);
+    task_notify(rx_task, UART_NOTIFY_RX);
+#if TASK_ISR_YIELD
+    task_yield_from_isr();
+#endif
   }
 }
 
-// Read data from UART.
-int uart_read(void *buf, size_t count) {
+// Start reading data. Bytes are taken from the private receive buffer, and
+// the interrupt handler reads the remaining bytes and notifies the task.
+// Returns the number of bytes left for the interrupt handler.
+size_t uart_read_begin(void *buf, size_t count) {
   uint8_t *bbuf = buf;
   uint8_t sreg;
-  int n = 0;
 
   sreg = SREG;
   cli();
@@ -229,24 +242,51 @@ int uart_read(void *buf, size_t count) {
 
     bbuf++;
     count--;
-    n++;
   }
 
-  // Wait for interrupt handler to populate remaining bytes.
+  // Let interrupt handler populate remaining bytes.
   if (count) {
     rx_task = task_current();
+    task_notify_take(UART_NOTIFY_RX);
     rx_buf = bbuf;
     rx_count = count;
-    n += count;
+  }
 
-    // Task is woken up by the interrupt handler when done.
-    task_suspend(NULL);
+  SREG = sreg;
+  return count;
+}
+
+// Read data from UART, waiting for at most the specified number of ticks (or
+// forever if 0). Returns the number of bytes read.
+static int uart__read(void *buf, size_t count, uint16_t ticks) {
+  uint8_t sreg;
+  int n = count;
+
+  sreg = SREG;
+  cli();
+
+  // Task is notified by the interrupt handler when done.
+  if (uart_read_begin(buf, count) &&
+      task__notify_wait(UART_NOTIFY_RX, TASK_NOTIFY_ANY, ticks) == 0) {
+    // Timed out. Bytes that arrive from now on go to the private buffer.
+    n -= rx_count;
+    rx_buf = NULL;
   }
 
   SREG = sreg;
   return n;
 }
 
+// Read data from UART.
+int uart_read(void *buf, size_t count) {
+  return uart__read(buf, count, 0);
+}
+
+// Read data from UART, waiting for at most the specified number of ms.
+int uart_read_timeout(void *buf, size_t count, uint16_t ms) {
+  return uart__read(buf, count, TASK_TIMEOUT_TICKS(ms));
+}
+
 // Read data from read buffer.
 int uart_read_nonblock(void *buf, size_t count) {
     uint8_t *bbuf = buf;
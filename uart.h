@@ -10,6 +10,15 @@
 #define UART_COUNT_RX_ERRORS
 #endif
 
+// Task notification bits used by the driver (see task_notify).
+#ifndef UART_NOTIFY_TX
+#define UART_NOTIFY_TX 0x01
+#endif
+
+#ifndef UART_NOTIFY_RX
+#define UART_NOTIFY_RX 0x02
+#endif
+
 #ifdef UART_COUNT_TX_BYTES
 extern uint16_t uart_tx_bytes;
 #endif
@@ -35,8 +44,40 @@ int uart_write(const void *buf, size_t count);
 
 int uart_read(void *buf, size_t count);
 
+// Returns the number of bytes read, which is less than count on timeout.
+int uart_read_timeout(void *buf, size_t count, uint16_t ms);
+
 int uart_read_nonblock(void *buf, size_t count);
 
+// Start writing or reading (the task is notified when done). The read
+// variant returns the number of bytes still to be received. Used by the
+// coroutine wrappers below.
+void uart_write_begin(const void *buf, size_t count);
+size_t uart_read_begin(void *buf, size_t count);
+
+#if TASK_COROUTINES
+// Write data from a coroutine (see task.h).
+#define TASK_CO_UART_WRITE(co, buf, count)                                    \
+  do {                                                                        \
+    uart_write_begin(buf, count);                                             \
+    if (task__notify_begin(UART_NOTIFY_TX, TASK_NOTIFY_ANY, 0)) {             \
+      TASK_CO_YIELD(co);                                                      \
+    }                                                                         \
+    task__notify_end(UART_NOTIFY_TX, TASK_NOTIFY_ANY);                        \
+  } while (0)
+
+// Read count bytes from a coroutine (see task.h).
+#define TASK_CO_UART_READ(co, buf, count)                                     \
+  do {                                                                        \
+    if (uart_read_begin(buf, count)) {                                        \
+      if (task__notify_begin(UART_NOTIFY_RX, TASK_NOTIFY_ANY, 0)) {           \
+        TASK_CO_YIELD(co);                                                    \
+      }                                                                       \
+      task__notify_end(UART_NOTIFY_RX, TASK_NOTIFY_ANY);                      \
+    }                                                                         \
+  } while (0)
+#endif
+
 int uart_putc(char c, FILE *unused);
 
 int uart_getc(FILE *unused);